@@ -0,0 +1,163 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+
+#include <getopt.h>
+
+#include "libgridfan.hpp"
+#include "metrics.hpp"
+
+// Latency/throughput benchmark of the libgridfan bus path, meant to be run
+// against either a real hub or the gridemu pseudo-terminal emulator.
+
+using namespace std::chrono;
+using namespace std::chrono_literals;
+
+using clock_type = std::chrono::steady_clock;
+
+static void report(const std::string& name, std::vector<double>& samples) {
+  if (samples.empty()) {
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  const auto n = samples.size();
+  const auto total = std::accumulate(samples.begin(), samples.end(), 0.0);
+  const auto at = [&](double q) { return samples[std::min(n - 1, size_t(q * n))]; };
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(2)
+            << " n=" << std::setw(5) << n
+            << " min=" << std::setw(8) << samples.front()
+            << " avg=" << std::setw(8) << total / n
+            << " p50=" << std::setw(8) << at(0.50)
+            << " p99=" << std::setw(8) << at(0.99)
+            << " max=" << std::setw(8) << samples.back()
+            << " ms  (" << std::setprecision(1) << 1000.0 * n / total << " ops/s)" << std::endl;
+}
+
+// "f" tells whether it succeeded, the failures are counted but not timed
+template <typename F>
+static void measure(std::vector<double>& samples, size_t& errors, F&& f) {
+  const auto start = clock_type::now();
+  if (f()) {
+    samples.push_back(duration<double, std::milli>(clock_type::now() - start).count());
+  } else {
+    ++errors;
+  }
+}
+
+static bool batch(grid::controller& controller, const std::vector<grid::controller::command>& commands) {
+  for (const auto& reply : controller.execute(commands)) {
+    if (grid::controller::result_t::ok != reply.result) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// same as batch() but through the non-blocking engine
+static bool pipeline(grid::controller& controller, const std::vector<grid::controller::command>& commands) {
+  size_t done = 0;
+  bool failed = false;
+  for (const auto& cmd : commands) {
+    controller.submit(cmd, [&](const grid::controller::reply& reply) {
+      failed |= grid::controller::result_t::ok != reply.result;
+      ++done;
+    });
+  }
+  while (done != commands.size()) {
+    controller.get_engine()->process(serial::infinite);
+  }
+  return not failed;
+}
+
+int main(int argc, char** argv) {
+
+  size_t iterations = 20;
+  bool calibrate = false;
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "n:ch"))) {
+    switch (c) {
+      case 'n': iterations = size_t(std::strtoul(optarg, nullptr, 10)); break;
+      case 'c': calibrate = true; break;
+      default:
+        std::cerr << "usage: " << argv[0] << " [-n ITERATIONS] [-c] DEVICE" << std::endl;
+        return 'h' == c ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc) {
+    std::cerr << "usage: " << argv[0] << " [-n ITERATIONS] [-c] DEVICE" << std::endl;
+    return 1;
+  }
+
+  const std::string device = argv[optind];
+
+  std::vector<double> init, get, set, get_sweep, set_sweep, async_sweep;
+  size_t errors = 0;
+
+  const auto start = clock_type::now();
+  grid::controller controller(std::nothrow, device);
+  init.push_back(duration<double, std::milli>(clock_type::now() - start).count());
+
+  if (not controller) {
+    std::cerr << "cannot access " << device << std::endl;
+    return 1;
+  }
+
+  if (calibrate) {
+    const auto start = clock_type::now();
+    const auto& t = controller.calibrate();
+    std::cout << "calibrated in " << duration_cast<milliseconds>(clock_type::now() - start).count() << " ms:"
+              << " ping=" << t.ping.count() << "us"
+              << " get=" << t.get.count() << "us"
+              << " set=" << t.set.count() << "us" << std::endl;
+  }
+
+  for (size_t i = 0; i < iterations; ++i) {
+    for (auto& fan : controller) {
+      measure(get, errors, [&]{ return bool(fan.tryGetSpeed()); });
+    }
+    for (auto& fan : controller) {
+      measure(set, errors, [&]{ return grid::result_t::ok == fan.tryForcePercent(i % 2 ? 40 : 80); });
+    }
+
+    std::vector<grid::controller::command> reads, writes;
+    for (const auto& fan : controller) {
+      reads.push_back(grid::controller::command::getSpeed(fan.id()));
+      writes.push_back(grid::controller::command::setPercent(fan.id(), i % 2 ? 80 : 40));
+    }
+    measure(get_sweep, errors, [&]{ return batch(controller, reads); });
+    measure(set_sweep, errors, [&]{ return batch(controller, writes); });
+    measure(async_sweep, errors, [&]{ return pipeline(controller, reads); });
+  }
+
+  // a controller going away with commands in flight must drop them quietly
+  // (the ones failing before, eg. on a missing hub, are not counted)
+  size_t completed = 0;
+  size_t before = 0;
+  {
+    grid::controller doomed(std::move(controller));
+    for (const auto& fan : doomed) {
+      doomed.submit(grid::controller::command::getSpeed(fan.id()), [&](const grid::controller::reply&) { ++completed; });
+    }
+    doomed.get_engine()->process(milliseconds::zero());
+    before = completed;
+  }
+  const size_t dropped = completed - before;
+
+  report("init", init);
+  report("get", get);
+  report("forcePercent", set);
+  report("get sweep", get_sweep);
+  report("set sweep", set_sweep);
+  report("async sweep", async_sweep);
+  // the set sweeps alternate their level, none of them should be skipped
+  const auto& skipped = grid::metrics::get_counter("gridfan_bus_skipped_sets_total", "SET_VOLTAGE commands not sent, the level being already applied");
+  std::cout << "errors: " << errors << ", skipped sets: " << skipped.value() << std::endl;
+  std::cout << "completions after destruction: " << dropped << std::endl;
+}
@@ -0,0 +1,392 @@
+#include <iostream>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <array>
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+// A pseudo-terminal backed emulator of the NZXT Grid+ v2 fan hub.
+// It speaks the same protocol libgridfan does so that grid::controller can
+// be pointed at the slave side ("/dev/pts/N") and exercised without the
+// real hardware, optionally injecting latency, jitter and line noise.
+
+using namespace std::chrono;
+using namespace std::chrono_literals;
+
+static constexpr uint8_t PING        = 0xC0;
+static constexpr uint8_t PING_OK     = 0x21;
+static constexpr uint8_t GET_UNKN1   = 0x84;
+static constexpr uint8_t GET_UNKN2   = 0x85;
+static constexpr uint8_t GET_RPM     = 0x8A;
+static constexpr uint8_t SET_VOLTAGE = 0x44;
+static constexpr uint8_t SET_OK      = 0x01;
+
+static bool stop = false;
+
+static void sig_handler(int) {
+  stop = true;
+}
+
+struct options {
+  milliseconds latency = 0ms;  // fixed delay before every reply
+  milliseconds jitter = 0ms;   // uniformly distributed extra delay
+  milliseconds min_gap = 0ms;  // commands sent sooner than this after a reply are missed
+  double drop = 0.0;           // probability of losing each reply byte
+  double garbage = 0.0;        // probability of a noise frame before a reply
+  unsigned fans = 0x3f;        // bitmask of the populated channels
+  unsigned seed = 0;
+  std::string link;            // optional symlink to the slave side
+  milliseconds up = 0ms;       // unplug the hub after this long, 0 = never
+  milliseconds down = 1s;      // and plug it back after this long
+  bool verbose = false;
+};
+
+class hub {
+public:
+
+  hub(int fd, const options& opt)
+    : master(fd)
+    , opt(opt)
+    , rng(opt.seed)
+  {
+    raw.fill(12); // the hub powers up at full speed
+  }
+
+  // a new pseudo-terminal: the hub powers up again, at full speed
+  void replug(int fd) {
+    master = fd;
+    raw.fill(12);
+    rx_size = 0;
+  }
+
+  void feed(uint8_t byte) {
+    if (0 == rx_size) {
+      missed = steady_clock::now() - last_reply < opt.min_gap;
+    }
+    rx[rx_size++] = byte;
+    if (rx_size == expected()) {
+      if (not missed) {
+        execute();
+      } else if (opt.verbose) {
+        std::cerr << "missed command 0x" << std::hex << int(rx[0]) << std::dec << std::endl;
+      }
+      rx_size = 0;
+    } else if (0 == expected()) {
+      if (opt.verbose) {
+        std::cerr << "ignoring 0x" << std::hex << int(byte) << std::dec << std::endl;
+      }
+      rx_size = 0;
+    }
+  }
+
+private:
+
+  // total length of the frame whose first byte has already been received,
+  // 0 for unknown commands
+  size_t expected() const {
+    switch (rx[0]) {
+      case PING:        return 1;
+      case GET_RPM:
+      case GET_UNKN1:
+      case GET_UNKN2:   return 2;
+      case SET_VOLTAGE: return 7;
+    }
+    return 0;
+  }
+
+  bool populated(uint8_t index) const {
+    return index >= 1 and index <= 6 and (opt.fans & (1u << (index - 1)));
+  }
+
+  uint16_t rpm(uint8_t index) {
+    if (not populated(index) or raw[index - 1] < 4) {
+      return 0;
+    }
+    std::uniform_int_distribution<int> noise(-15, 15);
+    return uint16_t(400 + raw[index - 1] * 110 + noise(rng));
+  }
+
+  void execute() {
+    const auto index = rx[1];
+
+    switch (rx[0]) {
+      case PING: {
+        const uint8_t answer[] = { PING_OK };
+        reply(answer, sizeof(answer));
+        break;
+      }
+      case GET_RPM:
+      case GET_UNKN1:
+      case GET_UNKN2: {
+        uint16_t value = 0;
+        if (index >= 1 and index <= 6) {
+          value = rx[0] == GET_RPM   ? rpm(index) :
+                  rx[0] == GET_UNKN1 ? uint16_t(raw[index - 1] << 8) :
+                                       uint16_t(populated(index) ? 1 : 0);
+        }
+        const uint8_t answer[] = { 0xC0, 0x00, 0x00, uint8_t(value >> 8), uint8_t(value) };
+        reply(answer, sizeof(answer));
+        break;
+      }
+      case SET_VOLTAGE: {
+        if (index >= 1 and index <= 6) {
+          raw[index - 1] = rx[5];
+        }
+        const uint8_t answer[] = { SET_OK };
+        reply(answer, sizeof(answer));
+        break;
+      }
+    }
+  }
+
+  void reply(const uint8_t* data, size_t size) {
+    auto delay = opt.latency;
+    if (opt.jitter > 0ms) {
+      std::uniform_int_distribution<milliseconds::rep> extra(0, opt.jitter.count());
+      delay += milliseconds(extra(rng));
+    }
+    std::this_thread::sleep_for(delay);
+
+    std::bernoulli_distribution noise(opt.garbage);
+    if (noise(rng)) {
+      std::uniform_int_distribution<int> length(1, 5), byte(0, 255);
+      uint8_t junk[5];
+      const auto n = length(rng);
+      for (int i = 0; i < n; ++i) {
+        junk[i] = uint8_t(byte(rng));
+      }
+      send(junk, size_t(n));
+    }
+
+    std::bernoulli_distribution lost(opt.drop);
+    uint8_t out[8];
+    size_t n = 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (not lost(rng)) {
+        out[n++] = data[i];
+      }
+    }
+    send(out, n);
+    last_reply = steady_clock::now();
+  }
+
+  void send(const uint8_t* data, size_t size) {
+    if (opt.verbose) {
+      std::cerr << "->";
+      for (size_t i = 0; i < size; ++i) {
+        std::cerr << " " << std::hex << int(data[i]) << std::dec;
+      }
+      std::cerr << std::endl;
+    }
+    while (size) {
+      const auto w = write(master, data, size);
+      if (w < 1) {
+        if (EINTR == errno or EAGAIN == errno) {
+          continue;
+        }
+        std::cerr << "write error: " << strerror(errno) << std::endl;
+        return;
+      }
+      data += w;
+      size -= size_t(w);
+    }
+  }
+
+  int master;
+  const options& opt;
+  std::mt19937 rng;
+  std::array<uint8_t, 6> raw;
+  uint8_t rx[8] = {};
+  size_t rx_size = 0;
+  bool missed = false;
+  steady_clock::time_point last_reply;
+};
+
+static void usage(const char* name) {
+  std::cerr << "usage: " << name << " [options]\n"
+            << "  -l, --latency MS   reply latency (default 0)\n"
+            << "  -j, --jitter MS    random extra latency up to MS (default 0)\n"
+            << "  -m, --min-gap MS   minimum idle time the hub needs between commands (default 0)\n"
+            << "  -d, --drop P       probability of dropping a reply byte (default 0)\n"
+            << "  -g, --garbage P    probability of a garbage frame before a reply (default 0)\n"
+            << "  -f, --fans MASK    populated channels bitmask (default 0x3f)\n"
+            << "  -s, --seed N       random seed (default 0)\n"
+            << "  -L, --link PATH    create a symlink to the slave device\n"
+            << "  -c, --cycle UP[:DOWN]  unplug the hub every UP seconds, for DOWN seconds (default 1),\n"
+            << "                     the pseudo-terminal and the link are removed and created again\n"
+            << "  -v, --verbose      dump the traffic on stderr\n";
+}
+
+// a new pseudo-terminal, whose slave side is kept open in "slave" and
+// linked from opt.link; -1 on failure
+static int plug(const options& opt, int& slave) {
+  const int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (-1 == master or 0 != grantpt(master) or 0 != unlockpt(master)) {
+    std::cerr << "cannot create the pseudo-terminal: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  const std::string slave_name = ptsname(master);
+
+  // keep the slave side open so that the master never reads EIO
+  // in between two clients, and make it raw until a client configures it
+  slave = open(slave_name.c_str(), O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (-1 == slave or 0 != tcgetattr(slave, &tio)) {
+    std::cerr << "cannot open " << slave_name << ": " << strerror(errno) << std::endl;
+    close(master);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if (not opt.link.empty()) {
+    unlink(opt.link.c_str());
+    if (0 != symlink(slave_name.c_str(), opt.link.c_str())) {
+      std::cerr << "cannot create " << opt.link << ": " << strerror(errno) << std::endl;
+      close(slave);
+      close(master);
+      return -1;
+    }
+  }
+
+  std::cout << slave_name << std::endl;
+  return master;
+}
+
+// the clients see a hang-up, like with a hub leaving the USB bus
+static void unplug(const options& opt, int master, int slave) {
+  if (not opt.link.empty()) {
+    unlink(opt.link.c_str());
+  }
+
+  close(slave);
+  close(master);
+}
+
+int main(int argc, char** argv) {
+
+  options opt;
+
+  static const struct option long_options[] = {
+    { "latency", required_argument, nullptr, 'l' },
+    { "jitter",  required_argument, nullptr, 'j' },
+    { "min-gap", required_argument, nullptr, 'm' },
+    { "drop",    required_argument, nullptr, 'd' },
+    { "garbage", required_argument, nullptr, 'g' },
+    { "fans",    required_argument, nullptr, 'f' },
+    { "seed",    required_argument, nullptr, 's' },
+    { "link",    required_argument, nullptr, 'L' },
+    { "cycle",   required_argument, nullptr, 'c' },
+    { "verbose", no_argument,       nullptr, 'v' },
+    { "help",    no_argument,       nullptr, 'h' },
+    { nullptr,   0,                 nullptr, 0 }
+  };
+
+  int c;
+  while (-1 != (c = getopt_long(argc, argv, "l:j:m:d:g:f:s:L:c:vh", long_options, nullptr))) {
+    switch (c) {
+      case 'l': opt.latency = milliseconds(std::strtol(optarg, nullptr, 10)); break;
+      case 'j': opt.jitter = milliseconds(std::strtol(optarg, nullptr, 10)); break;
+      case 'm': opt.min_gap = milliseconds(std::strtol(optarg, nullptr, 10)); break;
+      case 'd': opt.drop = std::strtod(optarg, nullptr); break;
+      case 'g': opt.garbage = std::strtod(optarg, nullptr); break;
+      case 'f': opt.fans = unsigned(std::strtoul(optarg, nullptr, 0)); break;
+      case 's': opt.seed = unsigned(std::strtoul(optarg, nullptr, 0)); break;
+      case 'L': opt.link = optarg; break;
+      case 'c': {
+        char* end = nullptr;
+        opt.up = milliseconds(milliseconds::rep(std::strtod(optarg, &end) * 1000));
+        if (':' == *end) {
+          opt.down = milliseconds(milliseconds::rep(std::strtod(end + 1, nullptr) * 1000));
+        }
+        break;
+      }
+      case 'v': opt.verbose = true; break;
+      default: usage(argv[0]); return 'h' == c ? 0 : 1;
+    }
+  }
+
+  signal(SIGINT,  &sig_handler);
+  signal(SIGTERM, &sig_handler);
+
+  int slave = -1;
+  int master = plug(opt, slave);
+
+  if (-1 == master) {
+    return 1;
+  }
+
+  hub device(master, opt);
+  auto unplug_at = steady_clock::now() + opt.up;
+
+  while (not stop) {
+    if (opt.up > 0ms and steady_clock::now() >= unplug_at) {
+      unplug(opt, master, slave);
+      if (opt.verbose) {
+        std::cerr << "unplugged" << std::endl;
+      }
+
+      const auto back = steady_clock::now() + opt.down;
+      while (not stop and steady_clock::now() < back) {
+        std::this_thread::sleep_for(std::min<steady_clock::duration>(50ms, back - steady_clock::now()));
+      }
+
+      if (stop or -1 == (master = plug(opt, slave))) {
+        return stop ? 0 : 1;
+      }
+      device.replug(master);
+      unplug_at = steady_clock::now() + opt.up;
+    }
+
+    struct pollfd pfd = { master, POLLIN, 0 };
+    const auto x = poll(&pfd, 1, 200);
+
+    if (x < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      std::cerr << "poll error: " << strerror(errno) << std::endl;
+      break;
+    }
+
+    if (0 == x) {
+      continue;
+    }
+
+    uint8_t buffer[64];
+    const auto r = read(master, buffer, sizeof(buffer));
+
+    if (r < 0) {
+      if (EINTR == errno or EAGAIN == errno) {
+        continue;
+      }
+      std::cerr << "read error: " << strerror(errno) << std::endl;
+      break;
+    }
+
+    if (opt.verbose) {
+      std::cerr << "<-";
+      for (ssize_t i = 0; i < r; ++i) {
+        std::cerr << " " << std::hex << int(buffer[i]) << std::dec;
+      }
+      std::cerr << std::endl;
+    }
+
+    for (ssize_t i = 0; i < r; ++i) {
+      device.feed(buffer[i]);
+    }
+  }
+
+  unplug(opt, master, slave);
+}
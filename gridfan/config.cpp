@@ -0,0 +1,275 @@
+#include "config.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+namespace config {
+
+  static std::string trim(const std::string& s) {
+    const auto b = s.find_first_not_of(" \t\r");
+    if (std::string::npos == b) {
+      return {};
+    }
+    const auto e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+  }
+
+  static std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, sep)) {
+      item = trim(item);
+      if (not item.empty()) {
+        out.push_back(item);
+      }
+    }
+    return out;
+  }
+
+  static std::runtime_error error(const std::string& filename, size_t line, const std::string& what) {
+    return std::runtime_error(filename + ":" + std::to_string(line) + ": " + what);
+  }
+
+  static std::chrono::milliseconds seconds(const std::string& value, const std::string& filename, size_t line) {
+    char* end = nullptr;
+    const auto x = std::strtod(value.c_str(), &end);
+    if (value.empty() or *end or x < 0) {
+      throw error(filename, line, "invalid amount of seconds '" + value + "'");
+    }
+    return std::chrono::milliseconds(std::chrono::milliseconds::rep(x * 1000));
+  }
+
+  // "TEMP:SPEED", in degrees and percent
+  static curve::point point(const std::string& item, const std::string& filename, size_t line) {
+    char* end = nullptr;
+    const auto t = std::strtod(item.c_str(), &end);
+    if (end == item.c_str() or ':' != *end) {
+      throw error(filename, line, "invalid curve point '" + item + "'");
+    }
+    const char* speed = end + 1;
+    const auto p = std::strtod(speed, &end);
+    if (end == speed or *end or p < 0 or p > 100) {
+      throw error(filename, line, "invalid curve point '" + item + "'");
+    }
+    return {int32_t(t * 1000), int32_t(p + 0.5)};
+  }
+
+  settings defaults() {
+    settings s;
+    zone z;
+    z.name = "cpu";
+    z.sensors = {"CPU Temperature"};
+    for (size_t id = 1; id <= 6; ++id) {
+      z.fans.push_back({0, id});
+    }
+    s.zones.push_back(z);
+    return s;
+  }
+
+  static void parse_zone_key(zone& z, const std::string& key, const std::string& value,
+                             const std::string& filename, size_t line) {
+    if ("sensors" == key) {
+      z.sensors = split(value, ',');
+    } else if ("fans" == key) {
+      z.fans.clear();
+      std::istringstream in(value);
+      std::string id;
+      while (in >> id) {
+        // "FAN" or "HUB:FAN", the hub is checked once the devices are known
+        fan f;
+        char* end = nullptr;
+        auto x = std::strtoul(id.c_str(), &end, 10);
+        if (':' == *end) {
+          const char* rest = end + 1;
+          if (end == id.c_str() or x < 1) {
+            throw error(filename, line, "invalid fan id '" + id + "'");
+          }
+          f.hub = x - 1;
+          x = std::strtoul(rest, &end, 10);
+          if (end == rest) {
+            throw error(filename, line, "invalid fan id '" + id + "'");
+          }
+        }
+        if (*end or x < 1 or x > 6) {
+          throw error(filename, line, "invalid fan id '" + id + "'");
+        }
+        f.id = x;
+        z.fans.push_back(f);
+      }
+    } else if ("curve" == key) {
+      std::istringstream in(value);
+      std::string type;
+      in >> type;
+      if ("pi" == type) {
+        double p[5] = {z.setpoint, z.kp, z.ki, z.min_speed, z.max_speed};
+        size_t n = 0;
+        while (n < 5 and in >> p[n]) {
+          ++n;
+        }
+        if ((n != 1 and n != 3 and n != 5) or not in.eof() or p[1] < 0 or p[2] < 0
+            or p[3] > p[4] or p[3] < 0 or p[4] > 100) {
+          throw error(filename, line, "invalid curve '" + value + "'");
+        }
+        z.curve = type;
+        z.setpoint = p[0];
+        z.kp = p[1];
+        z.ki = p[2];
+        z.min_speed = p[3];
+        z.max_speed = p[4];
+        return;
+      }
+      if ("linear" == type and not in.eof()) {
+        double p[4] = {0, 0, 0, 0};
+        size_t n = 0;
+        while (n < 4 and in >> p[n]) {
+          ++n;
+        }
+        if (n != 4 or not in.eof() or p[0] >= p[1] or p[2] > p[3] or p[2] < 0 or p[3] > 100) {
+          throw error(filename, line, "invalid curve '" + value + "'");
+        }
+        z.curve = "table";
+        z.points = {{int32_t(p[0] * 1000), int32_t(p[2] + 0.5)}, {int32_t(p[1] * 1000), int32_t(p[3] + 0.5)}};
+        return;
+      }
+      if ("table" == type) {
+        std::vector<curve::point> points;
+        std::string item;
+        while (in >> item) {
+          points.push_back(point(item, filename, line));
+        }
+        if (points.empty()) {
+          throw error(filename, line, "a table needs at least a TEMP:SPEED point");
+        }
+        for (size_t i = 1; i < points.size(); ++i) {
+          if (points[i].millidegrees <= points[i - 1].millidegrees) {
+            throw error(filename, line, "the table points must be sorted by temperature");
+          }
+        }
+        z.curve = type;
+        z.points = points;
+        return;
+      }
+      if (not curve::builtin(type)) {
+        std::string known;
+        for (const auto& name : curve::builtins()) {
+          known += " " + name;
+        }
+        throw error(filename, line, "unknown curve '" + type + "', expected pi, table or one of:" + known);
+      }
+      z.curve = type;
+    } else {
+      throw error(filename, line, "unknown zone key '" + key + "'");
+    }
+  }
+
+  settings load(const std::string& filename) {
+    std::ifstream in(filename);
+
+    if (not in) {
+      return defaults();
+    }
+
+    settings s;
+    zone* current = nullptr;
+    std::string text;
+    size_t line = 0;
+
+    while (std::getline(in, text)) {
+      ++line;
+      text = trim(text.substr(0, text.find('#')));
+
+      if (text.empty()) {
+        continue;
+      }
+
+      if ('[' == text.front()) {
+        if (']' != text.back()) {
+          throw error(filename, line, "unterminated section");
+        }
+        const auto words = split(text.substr(1, text.size() - 2), ' ');
+        if (words.size() != 2 or "zone" != words[0]) {
+          throw error(filename, line, "unknown section '" + text + "'");
+        }
+        s.zones.emplace_back();
+        current = &s.zones.back();
+        current->name = words[1];
+        continue;
+      }
+
+      const auto eq = text.find('=');
+      if (std::string::npos == eq) {
+        throw error(filename, line, "expected 'key = value'");
+      }
+
+      const auto key = trim(text.substr(0, eq));
+      const auto value = trim(text.substr(eq + 1));
+
+      if (current) {
+        parse_zone_key(*current, key, value, filename, line);
+      } else if ("device" == key) {
+        s.devices = split(value, ' ');
+        if (s.devices.empty()) {
+          throw error(filename, line, "expected 'device = PATH...'");
+        }
+      } else if ("interval" == key) {
+        const auto bounds = split(value, ' ');
+        if (bounds.size() != 2) {
+          throw error(filename, line, "expected 'interval = MIN MAX'");
+        }
+        s.min_interval = seconds(bounds[0], filename, line);
+        s.max_interval = seconds(bounds[1], filename, line);
+        if (s.min_interval <= std::chrono::milliseconds::zero() or s.min_interval > s.max_interval) {
+          throw error(filename, line, "invalid interval '" + value + "'");
+        }
+      } else if ("telemetry" == key) {
+        s.telemetry = seconds(value, filename, line);
+      } else if ("reprobe" == key) {
+        s.reprobe = seconds(value, filename, line);
+      } else if ("backend" == key) {
+        if ("libsensors" != value and "hwmon" != value) {
+          throw error(filename, line, "unknown backend '" + value + "'");
+        }
+        s.backend = value;
+      } else if ("hwmon" == key) {
+        s.hwmon = value;
+      } else if ("metrics" == key) {
+        s.metrics = value;
+      } else if ("metrics_group" == key) {
+        s.metrics_group = value;
+      } else {
+        throw error(filename, line, "unknown key '" + key + "'");
+      }
+    }
+
+    if (s.zones.empty()) {
+      s.zones = defaults().zones;
+    }
+
+    std::vector<std::pair<size_t, size_t>> used;
+    for (const auto& z : s.zones) {
+      if (z.sensors.empty() or z.fans.empty()) {
+        throw std::runtime_error(filename + ": zone '" + z.name + "' needs both sensors and fans");
+      }
+      for (const auto& f : z.fans) {
+        const auto name = std::to_string(f.hub + 1) + ":" + std::to_string(f.id);
+        // the amount of hubs is known only once they are discovered
+        const bool discovered = s.devices.size() == 1 and "auto" == s.devices.front();
+        if (f.hub >= s.devices.size() and not discovered) {
+          throw std::runtime_error(filename + ": zone '" + z.name + "': fan " + name + " refers to a missing hub");
+        }
+        const auto key = std::make_pair(f.hub, f.id);
+        if (used.end() != std::find(used.begin(), used.end(), key)) {
+          throw std::runtime_error(filename + ": fan " + name + " belongs to more than one zone");
+        }
+        used.push_back(key);
+      }
+    }
+
+    return s;
+  }
+}
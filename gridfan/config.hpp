@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "curve.hpp"
+
+// The daemon configuration, an INI-like file:
+//
+//   device = /dev/GridPlus0        (or several hubs: /dev/GridPlus0 /dev/GridPlus1, or auto)
+//   interval = 0.2 5
+//   telemetry = 10
+//   reprobe = 60
+//   backend = libsensors           (or hwmon, to read sysfs directly)
+//   hwmon = /sys/class/hwmon
+//   metrics = /run/gridfan/metrics.sock   (empty to disable)
+//   metrics_group = prometheus     (the group allowed to scrape, default: the daemon's own)
+//
+//   [zone cpu]
+//   sensors = CPU Temperature
+//   fans = 1 2 3
+//   curve = linear 30 75 20 100
+//
+//   [zone drives]
+//   sensors = temp1
+//   fans = 4 5
+//   curve = pi 45 5 0.2 20 100
+//
+//   [zone case]
+//   sensors = temp2
+//   fans = 6 2:1 2:2                 (HUB:FAN for the fans of the other hubs)
+//   curve = table 30:20 50:35 70:100    (or a built-in curve: silent, performance)
+//
+// Every zone drives its own fans from the hottest of its own sensors,
+// the hubs are numbered from 1 in the order of the device list.
+// Missing files result in the built-in defaults: a single zone driving
+// all the fans from "CPU Temperature".
+
+namespace config {
+
+  struct fan {
+    size_t hub = 0; // position in settings::devices
+    size_t id = 0;  // 1 to 6
+  };
+
+  struct zone {
+    std::string name;
+    std::vector<std::string> sensors;  // labels, as reported by libsensors
+    std::vector<fan> fans;
+    std::string curve = "linear";      // a built-in curve, table or pi
+    std::vector<curve::point> points;  // table only
+    double min_speed = 20.0;           // %, pi only
+    double max_speed = 100.0;          // %, pi only
+    double setpoint = 60.0;            // deg, pi only
+    double kp = 5.0;                   // %/deg, pi only
+    double ki = 0.2;                   // %/(deg*s), pi only
+  };
+
+  struct settings {
+    std::vector<std::string> devices = {"/dev/GridPlus0"}; // one per hub
+    std::chrono::milliseconds min_interval = std::chrono::milliseconds(200); // control loop period bounds
+    std::chrono::milliseconds max_interval = std::chrono::seconds(5);
+    std::chrono::milliseconds telemetry = std::chrono::seconds(10); // RPM sampling period, 0 = off
+    std::chrono::milliseconds reprobe = std::chrono::seconds(60);   // empty channels check period, 0 = off
+    std::string backend = "libsensors";   // where temperatures are read from, libsensors or hwmon
+    std::string hwmon = "/sys/class/hwmon"; // the sysfs root of the hwmon backend
+    std::string metrics = "/run/gridfan/metrics.sock"; // the metrics unix socket, empty = off
+    std::string metrics_group;            // the group owning the socket, empty = the daemon's own
+    std::vector<zone> zones;
+  };
+
+  static constexpr const char* default_file = "/etc/gridfan.conf";
+
+  settings defaults();
+
+  /**
+   * @brief parses "filename", if it does not exist the defaults are returned
+   * @throw std::runtime_error on syntax errors or invalid values
+   */
+  settings load(const std::string& filename);
+}
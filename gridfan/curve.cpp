@@ -0,0 +1,48 @@
+#include "curve.hpp"
+
+namespace curve {
+
+  constexpr int32_t table::first;
+  constexpr int32_t table::last;
+  constexpr int32_t table::step;
+  constexpr size_t table::size;
+  constexpr int32_t table::one;
+
+  // the default linear curve: 30 deg = 20%, 75 deg = 100%
+  static constexpr point linear_points[] = {{30000, 20}, {75000, 100}};
+  static constexpr point silent_points[] = {{40000, 20}, {60000, 30}, {75000, 60}, {85000, 100}};
+  static constexpr point performance_points[] = {{25000, 30}, {45000, 50}, {65000, 100}};
+
+  static constexpr table linear(linear_points);
+  static constexpr table silent(silent_points);
+  static constexpr table performance(performance_points);
+
+  static_assert(linear.percent(30000) == 20 and linear.percent(75000) == 100, "linear curve");
+  static_assert(linear.percent(52500) == 60, "linear curve");
+
+  static const struct {
+    const char* name;
+    const table* curve;
+  } all[] = {
+    {"linear", &linear},
+    {"silent", &silent},
+    {"performance", &performance},
+  };
+
+  const table* builtin(const std::string& name) {
+    for (const auto& b : all) {
+      if (name == b.name) {
+        return b.curve;
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<std::string> builtins() {
+    std::vector<std::string> names;
+    for (const auto& b : all) {
+      names.push_back(b.name);
+    }
+    return names;
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Fan curves as lookup tables: a piecewise linear temperature -> speed map
+// sampled every "step" millidegrees and stored in fixed point, so that
+// evaluating a curve is a single table lookup. The built-in curves are
+// computed at compile time.
+
+namespace curve {
+
+  struct point {
+    int32_t millidegrees;
+    int32_t percent;
+  };
+
+  class table {
+  public:
+
+    static constexpr int32_t first = 0;       // mdeg, lower temperatures map to the first entry
+    static constexpr int32_t last = 120000;   // mdeg, higher temperatures map to the last entry
+    static constexpr int32_t step = 100;      // mdeg
+    static constexpr size_t size = (last - first) / step + 1;
+    static constexpr int32_t one = 256;       // 1% in fixed point
+
+    /**
+     * @brief samples the segments joining "points", sorted by temperature;
+     * the speed is flat before the first point and after the last one
+     */
+    constexpr table(const point* points, size_t count) : values{} {
+      for (size_t i = 0; i < size; ++i) {
+        const int32_t t = first + int32_t(i) * step;
+        size_t k = 0;
+        while (k < count and points[k].millidegrees < t) {
+          ++k;
+        }
+        int64_t v = 0;
+        if (0 == k) {
+          v = int64_t(points[0].percent) * one;
+        } else if (count == k) {
+          v = int64_t(points[count - 1].percent) * one;
+        } else {
+          const auto& a = points[k - 1];
+          const auto& b = points[k];
+          v = int64_t(a.percent) * one
+            + (int64_t(b.percent - a.percent) * one * (t - a.millidegrees)) / (b.millidegrees - a.millidegrees);
+        }
+        values[i] = uint16_t(v);
+      }
+    }
+
+    template <size_t N>
+    constexpr explicit table(const point (&points)[N]) : table(points, N) {}
+
+    explicit table(const std::vector<point>& points) : table(points.data(), points.size()) {}
+
+    /**
+     * @brief the speed at "millidegrees", in 1/one of percent
+     */
+    constexpr uint16_t at(int32_t millidegrees) const {
+      return values[(millidegrees <= first) ? 0
+                  : (millidegrees >= last) ? size - 1
+                  : size_t(millidegrees - first + step / 2) / step];
+    }
+
+    /**
+     * @brief the speed at "millidegrees", rounded to the closest percent
+     */
+    constexpr int percent(int32_t millidegrees) const {
+      return (at(millidegrees) + one / 2) / one;
+    }
+
+  private:
+    uint16_t values[size];
+  };
+
+  /**
+   * @brief the built-in curve called "name", nullptr if there is none
+   */
+  const table* builtin(const std::string& name);
+
+  /**
+   * @brief the names of the built-in curves
+   */
+  std::vector<std::string> builtins();
+}
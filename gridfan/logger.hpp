@@ -1,8 +1,129 @@
 #pragma once
 
-#include <utility>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
+#include <unistd.h>
+
+// A log call packs its arguments into a fixed-size record, together with
+// the format and a thunk able to format them later: the synchronous
+// loggers format it right away, AsyncLog hands it to a background thread.
+// Strings are copied into the record (and truncated if they do not fit),
+// so that the record does not refer to anything owned by the caller.
+
+namespace logging {
+
+  struct record;
+
+  typedef void (*formatter)(const record&, char* out, size_t size);
+
+  struct record {
+    static constexpr size_t capacity = 192;
+
+    int pri;
+    std::chrono::system_clock::time_point when; // when the call was made, not when the record is written
+    const char* fmt;
+    formatter format;
+    size_t used; // bytes of "data" in use
+    alignas(8) unsigned char data[capacity];
+  };
+
+  // how an argument of type T is stored into a record and read back
+  template <typename T>
+  struct arg {
+    static_assert(std::is_trivially_copyable<T>::value, "log arguments must be trivially copyable");
+
+    typedef T type;
+
+    static bool pack(record& r, const T& value) {
+      const auto at = (r.used + alignof(T) - 1) / alignof(T) * alignof(T);
+      if (at + sizeof(T) > record::capacity) {
+        return false;
+      }
+      std::memcpy(r.data + at, &value, sizeof(T));
+      r.used = at + sizeof(T);
+      return true;
+    }
+
+    static T unpack(const record& r, size_t& at) {
+      at = (at + alignof(T) - 1) / alignof(T) * alignof(T);
+      T value;
+      std::memcpy(&value, r.data + at, sizeof(T));
+      at += sizeof(T);
+      return value;
+    }
+  };
+
+  template <>
+  struct arg<const char*> {
+    typedef const char* type;
+
+    static bool pack(record& r, const char* value) {
+      if (r.used >= record::capacity) {
+        return false;
+      }
+      const auto room = record::capacity - r.used - 1;
+      const auto n = value ? std::min(room, std::strlen(value)) : 0;
+      std::memcpy(r.data + r.used, value, n);
+      r.data[r.used + n] = 0;
+      r.used += n + 1;
+      return true;
+    }
+
+    static const char* unpack(const record& r, size_t& at) {
+      const auto value = reinterpret_cast<const char*>(r.data + at);
+      at += std::strlen(value) + 1;
+      return value;
+    }
+  };
+
+  template <>
+  struct arg<char*> : arg<const char*> {};
+
+  template <typename ...Args, size_t ...I>
+  static int format_tuple(char* out, size_t size, const char* fmt, const std::tuple<Args...>& args, std::index_sequence<I...>) {
+    return snprintf(out, size, fmt, std::get<I>(args)...);
+  }
+
+  template <typename ...Args>
+  static void format(const record& r, char* out, size_t size) {
+    size_t at = 0;
+    // a braced list is evaluated left to right, like the packing
+    const std::tuple<typename arg<Args>::type...> args{arg<Args>::unpack(r, at)...};
+    (void)at;
+    if (format_tuple(out, size, r.fmt, args, std::index_sequence_for<Args...>()) < 0) {
+      snprintf(out, size, "%s", r.fmt);
+    }
+  }
+
+  // for the records whose arguments did not fit
+  static inline void format_raw(const record& r, char* out, size_t size) {
+    snprintf(out, size, "%s", r.fmt);
+  }
+
+  template <typename ...Args>
+  static bool pack(record& r, const Args& ...args) {
+    const bool packed[] = {true, arg<Args>::pack(r, args)...};
+    for (const auto ok : packed) {
+      if (not ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+}
 
 class Logger {
 public:
@@ -19,16 +140,38 @@ public:
   inline void error(Args&&... args) {
     log(LOG_ERR, std::forward<Args>(args)...);
   }
+
+  /**
+   * @brief formats "r" and writes it, the synchronous loggers do it right away
+   */
+  virtual void submit(const logging::record& r) {
+    char temp[1024];
+    r.format(r, temp, sizeof(temp));
+    write(r.pri, r.when, temp);
+  }
+
+  virtual void flush() {}
+
+protected:
+  friend class AsyncLog;
+  virtual void write(int pri, std::chrono::system_clock::time_point when, const char* msg) = 0;
+
 private:
-  virtual void log(int pri, const char* msg) = 0;
   template <typename ...Args>
   inline void log(int pri, const char* fmt, const Args& ...args) {
-    char temp[1024];
-    const auto l = snprintf(temp, sizeof(temp), fmt, args...);
-    if (l > -1) {
-      temp[l] = 0;
-      log(pri, temp);
+    logging::record r;
+    r.pri = pri;
+    r.when = std::chrono::system_clock::now();
+    r.fmt = fmt;
+    r.used = 0;
+    if (logging::pack<std::decay_t<const Args>...>(r, args...)) {
+      r.format = &logging::format<std::decay_t<const Args>...>;
+    } else {
+      // too many arguments to fit, only the format is kept
+      r.used = 0;
+      r.format = &logging::format_raw;
     }
+    submit(r);
   }
 };
 
@@ -41,14 +184,20 @@ public:
     closelog();
   }
 private:
-  void log(int pri, const char* msg) override {
+  // syslog stamps the message itself, as it gets written
+  void write(int pri, std::chrono::system_clock::time_point, const char* msg) override {
     syslog(pri, "%s", msg);
   }
 };
 
 class LocalLog final : public Logger {
 public:
-  virtual ~LocalLog() override = default;
+  virtual ~LocalLog() override {
+    flush();
+  }
+  void flush() override {
+    std::cout.flush();
+  }
 private:
   static inline const char* prefix(int pri) {
     return pri == LOG_ERR ?     "[ERROR]" :
@@ -56,7 +205,170 @@ private:
            pri == LOG_INFO ?    "[INFO.]" :
                                 "[?????]";
   }
-  void log(int pri, const char* msg) override {
-    std::cout << prefix(pri) << " " << msg << std::endl;
+  // the time the record was logged at, not the one it is printed at
+  static void stamp(std::chrono::system_clock::time_point when, char* out, size_t size) {
+    using namespace std::chrono;
+    const auto t = system_clock::to_time_t(when);
+    const auto ms = duration_cast<milliseconds>(when.time_since_epoch()).count() % 1000;
+    struct tm local;
+    localtime_r(&t, &local);
+    const auto n = strftime(out, size, "%H:%M:%S", &local);
+    snprintf(out + n, size - n, ".%03d", int(ms));
+  }
+  void write(int pri, std::chrono::system_clock::time_point when, const char* msg) override {
+    char time[16];
+    stamp(when, time, sizeof(time));
+    std::cout << time << " " << prefix(pri) << " " << msg << '\n';
   }
 };
+
+// Hands the records to a background thread through a lock-free ring
+// (a bounded MPSC queue with one sequence number per slot), the thread
+// formats them and writes them to "sink". Logging never blocks nor
+// allocates: when the ring is full the record is dropped and counted.
+class AsyncLog final : public Logger {
+public:
+
+  static constexpr size_t slots = 256;
+
+  explicit AsyncLog(std::unique_ptr<Logger> sink)
+    : sink(std::move(sink))
+    , tail(0)
+    , head(0)
+    , lost(0)
+    , sleeping(false)
+    , running(true)
+    , wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    for (size_t i = 0; i < slots; ++i) {
+      ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    thread = std::thread(&AsyncLog::run, this);
+  }
+
+  virtual ~AsyncLog() override {
+    running = false;
+    wake();
+    thread.join();
+    close(wakeup);
+  }
+
+  void submit(const logging::record& r) override {
+    auto pos = tail.load(std::memory_order_relaxed);
+
+    while (true) {
+      auto& s = ring[pos % slots];
+      const auto seq = s.seq.load(std::memory_order_acquire);
+      const auto diff = intptr_t(seq) - intptr_t(pos);
+
+      if (0 == diff) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          s.r = r;
+          s.seq.store(pos + 1, std::memory_order_release);
+          break;
+        }
+      } else if (diff < 0) {
+        lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+
+  /**
+   * @brief the amount of records dropped because the ring was full
+   */
+  size_t dropped() const {
+    return lost.load(std::memory_order_relaxed);
+  }
+
+private:
+
+  struct slot {
+    std::atomic<size_t> seq;
+    logging::record r;
+  };
+
+  void write(int pri, std::chrono::system_clock::time_point when, const char* msg) override {
+    sink->write(pri, when, msg);
+  }
+
+  void wake() {
+    const uint64_t one = 1;
+    (void)::write(wakeup, &one, sizeof(one));
+  }
+
+  bool drain() {
+    bool any = false;
+    char text[1024];
+
+    while (true) {
+      auto& s = ring[head % slots];
+
+      if (s.seq.load(std::memory_order_acquire) != head + 1) {
+        break;
+      }
+
+      s.r.format(s.r, text, sizeof(text));
+      const auto pri = s.r.pri;
+      const auto when = s.r.when;
+      s.seq.store(head + slots, std::memory_order_release);
+      ++head;
+
+      sink->write(pri, when, text);
+      any = true;
+    }
+
+    return any;
+  }
+
+  void run() {
+    size_t reported = 0;
+
+    while (true) {
+      const bool stopping = not running.load();
+
+      if (drain()) {
+        sink->flush();
+      }
+
+      const auto n = dropped();
+      if (n != reported) {
+        char text[64];
+        snprintf(text, sizeof(text), "%zu log records dropped", n - reported);
+        sink->write(LOG_WARNING, std::chrono::system_clock::now(), text);
+        sink->flush();
+        reported = n;
+      }
+
+      if (stopping) {
+        break;
+      }
+
+      // producers only pay for the wakeup while the thread sleeps
+      sleeping.store(true, std::memory_order_seq_cst);
+      if (ring[head % slots].seq.load(std::memory_order_seq_cst) != head + 1 and running.load()) {
+        struct pollfd pfd = {wakeup, POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        uint64_t count;
+        (void)::read(wakeup, &count, sizeof(count));
+      }
+      sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  std::unique_ptr<Logger> sink;
+  slot ring[slots];
+  std::atomic<size_t> tail;
+  size_t head; // consumer only
+  std::atomic<size_t> lost;
+  std::atomic<bool> sleeping;
+  std::atomic<bool> running;
+  int wakeup;
+  std::thread thread;
+};
@@ -6,172 +6,703 @@
 #include <fstream>
 #include <unordered_map>
 #include <numeric>
+#include <vector>
 #include <csignal>
+#include <cctype>
 #include <cmath>
+#include <cstring>
+#include <cerrno>
 #include <ctime>
+#include <string>
+#include <memory>
+#include <thread>
+
+#include <unistd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 #include "temperature.hpp"
 #include "libgridfan.hpp"
+#include "metrics.hpp"
+#include "trace.h"
+#include "worker.hpp"
 #include "logger.hpp"
+#include "config.hpp"
+#include "zone.hpp"
 
 using namespace std::chrono;
 using namespace std::chrono_literals;
 
-static bool stop = false;
-static int got_signal = 0;
-static bool verbose_trigger = false;
-static bool verbose = false;
+GRID_TRACE_PROBE(tick)
 
-static void sig_handler(int sig) {
-  if (SIGUSR1 == sig) {
-    verbose_trigger = true;
-    return;
+// registered at load time like the bus metrics
+namespace {
+  namespace stats {
+    grid::metrics::histogram& tick_latency = grid::metrics::get_histogram("gridfan_tick_seconds", "Control loop iterations duration");
+    grid::metrics::counter& overruns = grid::metrics::get_counter("gridfan_tick_overruns_total", "Control loop iterations that missed their deadline");
   }
-  stop = true;
-  got_signal = sig;
 }
 
-template <typename R, typename P>
-static std::chrono::duration<R,P> interruptible_sleep(const std::chrono::duration<R,P>& dur) {
+static bool watch(int epoll, int fd) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return 0 == epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// arms "timer" to expire at "when", CLOCK_MONOTONIC being the steady_clock one
+static void arm(int timer, std::chrono::steady_clock::time_point when) {
   using namespace std::chrono;
-  const auto sec = duration_cast<seconds>(dur).count();
-  const auto nsec = (duration_cast<nanoseconds>(dur) - seconds(sec)).count();
-  const struct timespec ts = {sec, nsec};
-  struct timespec rm = {0, 0};
-  const auto x = nanosleep(&ts, &rm);
-  if (-1 == x and EINTR == errno) {
-    return duration_cast<duration<R,P>>(seconds(rm.tv_sec) + nanoseconds(rm.tv_nsec));
-  }
-  return {};
+  const auto ns = duration_cast<nanoseconds>(when.time_since_epoch()).count();
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  if (0 == spec.it_value.tv_sec and 0 == spec.it_value.tv_nsec) {
+    spec.it_value.tv_nsec = 1; // zero would disarm it
+  }
+  timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr);
 }
 
-template <typename T>
-static T clamp(const T& min, const T& max, const T& val) {
-  return std::min(max, std::max(min, val));
+// a non-blocking unix stream socket listening on "path", -1 on failure;
+// the socket is made rw for its owner and "group" (-1 = the daemon's own),
+// whatever the umask, so that an unprivileged exporter can connect
+static int listen_on(const std::string& path, gid_t group) {
+  struct sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  unlink(path.c_str()); // left behind by a previous run
+  if (0 != bind(fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) or
+      0 != chown(path.c_str(), static_cast<uid_t>(-1), group) or 0 != chmod(path.c_str(), 0660) or
+      0 != listen(fd, 4)) {
+    const auto e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return fd;
 }
 
-static inline double linear(double temp) {
-  constexpr auto min_tmp = 30.0;  // deg
-  constexpr auto max_tmp = 75.0;  // deg
-  constexpr auto min_spd = 20.0;  // %
-  constexpr auto max_spd = 100.0; // %
-  return clamp(min_spd, max_spd, min_spd + (max_spd - min_spd) / (max_tmp - min_tmp) * (temp - min_tmp));
+// A metrics scrape in progress: the connection is non-blocking and driven by
+// the main loop like every other fd, the request is collected across events
+// until its blank line and the response is written as the client takes it.
+// A scrape gets one absolute deadline, a client too slow is dropped rather
+// than allowed to hold up the ticks.
+struct scrape {
+  static constexpr size_t max_request = 4096;
+  static constexpr size_t max_pending = 8;
+  static constexpr milliseconds patience = 1s;
+
+  std::string request;
+  std::string response;
+  size_t sent = 0;
+  steady_clock::time_point deadline;
 };
 
-static inline double softplus(double x) {
-  return log1p(exp(x));
+constexpr size_t scrape::max_request;
+constexpr size_t scrape::max_pending;
+constexpr milliseconds scrape::patience;
+
+// takes the pending connections, the ones beyond scrape::max_pending are turned down
+static void accept_scrapes(int listener, int epoll, std::unordered_map<int, scrape>& scrapes) {
+  int fd;
+  while (0 <= (fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+    if (scrapes.size() >= scrape::max_pending or not watch(epoll, fd)) {
+      close(fd);
+      continue;
+    }
+    scrapes[fd].deadline = steady_clock::now() + scrape::patience;
+  }
 }
 
-static inline double logistic(double x) {
-  return 1.0 / (1.0 + exp(-x));
+// Moves the scrape on "fd" forward as far as it goes without blocking: the
+// current metrics are rendered once the request is complete (it is not
+// otherwise parsed) and sent as an HTTP/1.0 response.
+// @return true once the scrape is over, either way
+static bool serve_scrape(int epoll, int fd, scrape& s) {
+  if (s.response.empty()) {
+    char chunk[512];
+    ssize_t n;
+    bool complete = false;
+
+    while (0 < (n = recv(fd, chunk, sizeof(chunk), 0))) {
+      s.request.append(chunk, size_t(n));
+    }
+
+    if (0 == n) {
+      complete = true; // the client is done writing, answer what it sent
+    } else if (EAGAIN != errno and EWOULDBLOCK != errno) {
+      return true;
+    }
+
+    complete = complete or std::string::npos != s.request.find("\r\n\r\n") or s.request.size() >= scrape::max_request;
+    if (not complete) {
+      return false;
+    }
+
+    const auto body = grid::metrics::render();
+    s.response = "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                 "\r\n" + body;
+  }
+
+  while (s.sent < s.response.size()) {
+    const auto n = send(fd, s.response.data() + s.sent, s.response.size() - s.sent, MSG_NOSIGNAL);
+    if (n < 0 and (EAGAIN == errno or EWOULDBLOCK == errno)) {
+      // the rest goes out once the client made room for it
+      struct epoll_event ev = {};
+      ev.events = EPOLLOUT;
+      ev.data.fd = fd;
+      return 0 != epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &ev);
+    }
+    if (n <= 0) {
+      return true;
+    }
+    s.sent += size_t(n);
+  }
+
+  return true;
 }
 
-int main() {
+// The next tick comes early enough for the hottest zone to rise by "step"
+// degrees at most while the temperature climbs, while it is flat and the
+// fans are settled the interval doubles; fans still ramping down keep the
+// 1s pace the ramp is tuned for.
+static std::chrono::milliseconds next_interval(std::chrono::milliseconds current, double slope, bool settled,
+                                               const config::settings& s) {
+  using namespace std::chrono;
+  static constexpr double step = 0.5;  // deg
+  static constexpr double flat = 0.05; // deg/s
+  milliseconds next = 1s;
+
+  if (slope > flat) {
+    next = milliseconds(milliseconds::rep(1000.0 * step / slope));
+  } else if (settled) {
+    next = current * 2;
+  }
 
-  signal(SIGINT,  &sig_handler);
-  signal(SIGQUIT, &sig_handler);
-  signal(SIGTERM, &sig_handler);
-  signal(SIGUSR1, &sig_handler);
+  return std::min(s.max_interval, std::max(s.min_interval, next));
+}
 
-  using Log = SysLog;
+// A Grid+ hub, driven by its own worker thread through its own serial
+// engine: a slow or dead hub never holds up the others, nor the ticks.
+struct hub {
+  std::string device;
+  std::string timings_file;
+  std::unique_ptr<grid::worker> bus; // null if the hub could not be brought up
+  size_t errors = 0;
+  uint32_t fans = 0;
+  bool connected = true;
+  bool failed = false;
+};
 
-  Log log;
+// the bus gaps learned by the calibration are kept across restarts, one
+// file per hub named after its device node (the /dev/serial/by-id names
+// follow the hub itself), so that adding or removing a hub does not hand
+// its gaps to another one
+static std::string timings_file(const std::string& device) {
+  std::string name = device.substr(device.find_last_of('/') + 1);
+  for (auto& c : name) {
+    if (not std::isalnum(static_cast<unsigned char>(c)) and nullptr == std::strchr("-_.:+", c)) {
+      c = '_';
+    }
+  }
+  return "/var/lib/gridfan/timings." + name;
+}
 
-  grid::controller controller(std::nothrow);
+// initializes the controller, loads or calibrates the bus timings, looks
+// for the populated channels and hands the controller to a worker
+static void bring_up(hub& h, Logger& log) {
+  const auto name = h.device.c_str();
+  grid::controller controller(std::nothrow, h.device);
 
-  if(not controller) {
-    log.error("cannot access the fan controller");
-    return 1;
+  if (not controller) {
+    log.error("%s: cannot access the fan controller", name);
+    return;
   }
 
-  temperature::monitor monitor;
+  grid::timings timings;
+
+  // gaps all at the maximum are what a noisy spell used to leave behind
+  // before only the learned ones were saved, they are learned again
+  const auto saturated = [](const grid::timings& t) {
+    return t.ping == grid::timings::max and t.get == grid::timings::max and t.set == grid::timings::max;
+  };
+
+  if (timings.load(h.timings_file) and not saturated(timings)) {
+    controller.set_timings(timings);
+  } else {
+    log.info("%s: calibrating the bus timings", name);
+    timings = controller.calibrate();
+    if (not timings.save(h.timings_file)) {
+      log.warning("%s: cannot save the bus timings to %s", name, h.timings_file.c_str());
+    }
+  }
 
-  if(not monitor) {
-    log.error("cannot access the temperature monitor");
+  log.info("%s: bus gaps: ping %lldus, get %lldus, set %lldus", name,
+    static_cast<long long>(timings.ping.count()),
+    static_cast<long long>(timings.get.count()),
+    static_cast<long long>(timings.set.count()));
+
+  // the empty channels are not worth any bus time
+  const auto found = controller.detect();
+  std::string ids;
+  for (const auto& f : controller) {
+    ids += " " + std::to_string(f.id());
+  }
+  log.info("%s: %zu fans found:%s", name, found, ids.c_str());
+
+  h.fans = 0;
+  for (const auto& f : controller) {
+    h.fans |= 1u << f.id();
+  }
+  h.bus.reset(new grid::worker(std::move(controller), h.device));
+}
+
+static void usage(const char* name) {
+  std::cerr << "usage: " << name << " [-c CONFIG] [-d]\n"
+            << "  -c CONFIG  configuration file (default " << config::default_file << ")\n"
+            << "  -d         log to the standard output instead of syslog" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+  std::string config_file = config::default_file;
+  bool local = false;
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "c:dh"))) {
+    switch (c) {
+      case 'c': config_file = optarg; break;
+      case 'd': local = true; break;
+      default: usage(argv[0]); return 'h' == c ? 0 : 1;
+    }
+  }
+
+  // the signals are handled by the main loop through a signalfd, blocking
+  // them here makes every thread started later on inherit the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  for (const auto sig : {SIGINT, SIGQUIT, SIGTERM, SIGUSR1}) {
+    sigaddset(&signals, sig);
+  }
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  // the control loop never waits for the log output
+  std::unique_ptr<Logger> sink;
+  if (local) {
+    sink.reset(new LocalLog);
+  } else {
+    sink.reset(new SysLog);
+  }
+  AsyncLog logger(std::move(sink));
+  Logger& log = logger;
+
+  config::settings settings;
+
+  try {
+    settings = config::load(config_file);
+  } catch (const std::exception& ex) {
+    log.error("invalid configuration: %s", ex.what());
     return 1;
   }
 
-  const auto cpu = monitor.find("CPU Temperature");
+  // the hubs are brought up concurrently, the init and the detection of
+  // the fans take seconds; from then on every bus is driven by its own
+  // thread and the loop below only posts targets, it never waits for a
+  // serial line
+  // "auto" stands for every hub found in /dev/serial/by-id, whose
+  // names survive a re-enumeration of the hub
+  auto devices = settings.devices;
+  if (devices.size() == 1 and "auto" == devices.front()) {
+    devices = grid::controller::discover();
+    if (devices.empty()) {
+      log.error("cannot find any fan controller");
+      return 1;
+    }
+  }
 
-  if(cpu == monitor.end()) {
-    log.error("cannot find the CPU temperature sensor");
+  for (const auto& z : settings.zones) {
+    for (const auto& f : z.fans) {
+      if (f.hub >= devices.size()) {
+        log.error("zone %s: hub %zu not found", z.name.c_str(), f.hub + 1);
+        return 1;
+      }
+    }
+  }
+
+  std::vector<hub> hubs(devices.size());
+  std::vector<std::thread> starting;
+
+  for (size_t i = 0; i < hubs.size(); ++i) {
+    hubs[i].device = devices[i];
+    hubs[i].timings_file = timings_file(devices[i]);
+    starting.emplace_back(bring_up, std::ref(hubs[i]), std::ref(log));
+  }
+  for (auto& t : starting) {
+    t.join();
+  }
+
+  size_t alive = 0;
+  for (const auto& h : hubs) {
+    if (h.bus) {
+      h.bus->sample_every(settings.telemetry);
+      h.bus->reprobe_every(settings.reprobe);
+      ++alive;
+    }
+  }
+
+  if (0 == alive) {
     return 1;
   }
 
-  log.info("started");
+  // fans are named "HUB:FAN" only when there is more than one hub
+  const auto fan_name = [&](size_t hub, size_t id) {
+    return (hubs.size() > 1 ? std::to_string(hub + 1) + ":" : std::string()) + std::to_string(id);
+  };
 
-  using func_t = double (*) (double);
-  func_t func = &linear;
+  // only the sensors used by the zones are looked for,
+  // hwmon skips libsensors altogether and keeps the sysfs files open
+  std::vector<std::string> wanted;
+  for (const auto& z : settings.zones) {
+    wanted.insert(wanted.end(), z.sensors.begin(), z.sensors.end());
+  }
 
-  static constexpr milliseconds interval = 1s;
-  int last_p = -1;
+  const bool hwmon = "hwmon" == settings.backend;
+  temperature::monitor monitor(hwmon ? temperature::hwmon_backend(settings.hwmon) : temperature::libsensors_backend(), wanted);
 
-  size_t errors = 0;
-  constexpr size_t max_errors = 5;
+  if(not monitor) {
+    log.error("cannot access the temperature monitor");
+    return 1;
+  }
+  log.info("temperature backend: %s (%s)", settings.backend.c_str(), monitor.version());
+
+  // the hwmon labels seldom match the libsensors ones, eg. there is no
+  // "CPU Temperature" there: tell what is available
+  const auto found = [&](const std::string& label) { return nullptr != monitor.find(label); };
+  if (hwmon and std::none_of(wanted.begin(), wanted.end(), found)) {
+    std::string labels;
+    for (const auto* s : monitor) {
+      labels += (labels.empty() ? "'" : ", '") + s->name() + "'";
+    }
+    log.warning("none of the configured sensors exists under %s, its sensors are: %s",
+                settings.hwmon.c_str(), labels.empty() ? "none" : labels.c_str());
+  }
+
+  // every sensor is read once per tick, even if shared by several zones
+  std::vector<zone> zones;
+  std::vector<const temperature::sensor*> used;
+
+  for (const auto& z : settings.zones) {
+    std::vector<size_t> sensors;
+    for (const auto& label : z.sensors) {
+      const auto* s = monitor.find(label);
+      if (not s) {
+        log.error("zone %s: cannot find the '%s' temperature sensor", z.name.c_str(), label.c_str());
+        return 1;
+      }
+      const auto pos = std::find(used.begin(), used.end(), s);
+      sensors.push_back(size_t(pos - used.begin()));
+      if (pos == used.end()) {
+        used.push_back(s);
+      }
+    }
+    zones.emplace_back(z, std::move(sensors));
+  }
 
-  while(not stop) {
+  auto readings = monitor.prepare(std::move(used));
+  monitor.read(readings);
 
-    try {
-      const auto t = cpu->temperature();
-      const auto p = int(func(t));
+  log.info("started");
 
-      if (verbose_trigger) {
-        verbose_trigger = false;
-        verbose = not verbose;
-        log.info("verbose mode %s", verbose ? "activated" : "deactivated");
-        if (verbose) {
-          log.info("current temperature is %.2f degree", t);
-          log.info("current speed is %d%%", p);
+  // the tick interval follows the temperature trend, see next_interval()
+  auto interval = std::min(settings.max_interval, std::max(settings.min_interval, milliseconds(1s)));
+  std::vector<double> previous;
+  auto previous_taken = readings.taken;
+
+  for (const auto& z : zones) {
+    previous.push_back(z.temperature(readings));
+  }
+
+  bool verbose = false;
+  bool stop = false;
+  int got_signal = 0;
+
+  const auto toggle_verbose = [&]() {
+    verbose = not verbose;
+    log.info("verbose mode %s", verbose ? "activated" : "deactivated");
+    if (verbose) {
+      for (const auto& z : zones) {
+        log.info("zone %s: current temperature is %.2f degree", z.name().c_str(), z.temperature(readings));
+        log.info("zone %s: current speed is %d%%", z.name().c_str(), z.target());
+      }
+      for (size_t i = 0; i < hubs.size(); ++i) {
+        for (grid::fan::id_t id = 1; hubs[i].bus and id <= 6; ++id) {
+          grid::sample last;
+          if (hubs[i].bus->telemetry(id, &last, 1)) {
+            const auto age = duration_cast<seconds>(steady_clock::now() - last.when).count();
+            log.info("fan %s: %d rpm (%lds ago)", fan_name(i, id).c_str(), last.rpm, long(age));
+          }
         }
       }
-
-      // changes in fan speed are triggered only if either
-      // - desired speed is higher than current speed
-      //                     or
-      // - desired speed is "way" lower than current speed (5%)
-
-      if(p > last_p or last_p - p > 5) {
-        // if desired speed is lower than current speed, slowly decrease it
-        // at a maximum rate of -10% per second
-        if(p < last_p) {
-          last_p = std::max(p, last_p - 10);
-        } else {
-          last_p = p;
+    }
+  };
+
+  // only the fans of the zones whose target changed are sent a command
+  const auto tick = [&]() {
+    const grid::metrics::timer timer(stats::tick_latency);
+    GRID_TRACE_START(started, tick);
+    unsigned updated = 0;
+    monitor.read(readings);
+
+    const auto elapsed = duration<double>(readings.taken - previous_taken).count();
+    double slope = 0.0; // the steepest rise among the zones, deg/s
+    bool settled = true;
+
+    for (size_t i = 0; i < zones.size(); ++i) {
+      auto& z = zones[i];
+      const auto t = z.temperature(readings);
+      bool changed;
+
+      // a zone none of whose sensors can be read is not given a made up
+      // temperature, its fans run at full speed until a sensor is back
+      if (std::isnan(t)) {
+        if (not z.blind()) {
+          log.warning("zone %s: none of its sensors can be read, running its fans at full speed", z.name().c_str());
         }
+        changed = z.fail_safe();
+      } else {
+        if (z.blind()) {
+          log.info("zone %s: its sensors can be read again", z.name().c_str());
+        }
+        if (elapsed > 0 and not std::isnan(previous[i])) {
+          slope = std::max(slope, (t - previous[i]) / elapsed);
+        }
+        changed = z.update(t, elapsed > 0 ? elapsed : 1.0);
+      }
+      previous[i] = t;
 
+      if (changed) {
+        ++updated;
         if (verbose) {
-          log.info("temp is %.1f deg, setting fans speed to %d%%", t, last_p);
+          log.info("zone %s: temp is %.1f deg, setting fans speed to %d%%", z.name().c_str(), t, z.target());
         }
-
-        for (auto& fan : controller) {
-          fan.setPercent(last_p);
+        for (const auto& f : z.fans()) {
+          if (hubs[f.hub].bus) {
+            hubs[f.hub].bus->set(f.id, z.target());
+          }
         }
       }
 
-      errors = 0;
-      interruptible_sleep(interval);
-      if (stop) break;
+      settled = settled and z.settled();
+    }
 
-    } catch(const std::exception& ex) {
+    previous_taken = readings.taken;
+    const auto next = next_interval(interval, slope, settled, settings);
+    if (verbose and next != interval) {
+      log.info("tick interval is now %lldms", static_cast<long long>(next.count()));
+    }
+    interval = next;
+    GRID_TRACE(tick, updated, interval.count(), GRID_TRACE_ELAPSED(started));
+  };
+
+  // the workers signal every published result, errors are reported right
+  // away; a hub giving up is left alone, the daemon stops with the last one
+  const auto check_bus = [&](size_t index) {
+    auto& h = hubs[index];
+    auto& bus = *h.bus;
+    const auto name = h.device.c_str();
+
+    if (bus.errors() != h.errors) {
+      h.errors = bus.errors();
+      if (h.errors) {
+        log.warning("%s: fan bus error: %s", name, grid::to_string(bus.last_error()));
+      }
+    }
 
-      if(++errors == max_errors) {
-        log.error("exception caught: %s", ex.what());
-        log.error("too many errors, giving up");
-        stop = true;
+    if (bus.connected() != h.connected) {
+      h.connected = bus.connected();
+      if (h.connected) {
+        log.info("%s: reconnected", name);
       } else {
-        log.warning("exception caught: %s", ex.what());
+        log.warning("%s: disconnected, waiting for it to come back", name);
+      }
+    }
 
-        interruptible_sleep(5s);
-        if (stop) break;
+    if (bus.fans() != h.fans) {
+      const auto now = bus.fans();
+      for (grid::fan::id_t id = 1; id <= 6; ++id) {
+        if ((now ^ h.fans) & (1u << id)) {
+          log.info("fan %s %s", fan_name(index, id).c_str(), (now & (1u << id)) ? "connected" : "disconnected");
+        }
+      }
+      h.fans = now;
+    }
 
-        controller = grid::controller();
+    if (bus.failed() and not h.failed) {
+      log.error("%s: too many errors or could not re-initialize the controller, giving up", name);
+      h.failed = true;
+      stop = (0 == --alive);
+    }
+  };
+
+  // a single loop waits for signals, ticks and bus results; the ticks
+  // follow absolute deadlines so that they do not drift
+  const int sfd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  const int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  const int efd = epoll_create1(EPOLL_CLOEXEC);
+
+  bool ready = sfd >= 0 and tfd >= 0 and efd >= 0 and watch(efd, sfd) and watch(efd, tfd);
+  for (const auto& h : hubs) {
+    ready = ready and (not h.bus or watch(efd, h.bus->fd()));
+  }
 
-        if(not controller) {
-          log.error("could not re-initialize the controller");
-          stop = true;
+  if (not ready) {
+    log.error("cannot set up the event loop: %s", strerror(errno));
+    stop = true;
+  }
+
+  // the metrics are optional, the daemon runs without them
+  int mfd = -1;
+  gid_t group = static_cast<gid_t>(-1);
+  if (not settings.metrics_group.empty()) {
+    const auto* g = getgrnam(settings.metrics_group.c_str());
+    if (g) {
+      group = g->gr_gid;
+    } else {
+      log.warning("unknown metrics group '%s', the socket is left to the daemon's own", settings.metrics_group.c_str());
+    }
+  }
+  if (not settings.metrics.empty()) {
+    mfd = listen_on(settings.metrics, group);
+    if (mfd >= 0 and not watch(efd, mfd)) {
+      close(mfd);
+      mfd = -1;
+    }
+    if (mfd < 0) {
+      log.warning("cannot serve the metrics on %s: %s", settings.metrics.c_str(), strerror(errno));
+    }
+  }
+
+  auto deadline = steady_clock::now();
+  arm(tfd, deadline);
+
+  std::unordered_map<int, scrape> scrapes;
+
+  const auto finish_scrape = [&](int fd) {
+    close(fd); // which also takes it out of the epoll set
+    scrapes.erase(fd);
+  };
+
+  while (not stop) {
+    // the loop wakes up for the earliest scrape deadline as well
+    int timeout = -1;
+    if (not scrapes.empty()) {
+      auto earliest = steady_clock::time_point::max();
+      for (const auto& s : scrapes) {
+        earliest = std::min(earliest, s.second.deadline);
+      }
+      timeout = int(std::max<milliseconds::rep>(0, duration_cast<milliseconds>(earliest - steady_clock::now()).count() + 1));
+    }
+
+    struct epoll_event events[16];
+    const auto n = epoll_wait(efd, events, 16, timeout);
+
+    if (n < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      log.error("event loop failure: %s", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n and not stop; ++i) {
+      const auto fd = events[i].data.fd;
+
+      if (sfd == fd) {
+        struct signalfd_siginfo info;
+        while (sizeof(info) == read(sfd, &info, sizeof(info))) {
+          if (SIGUSR1 == info.ssi_signo) {
+            toggle_verbose();
+          } else {
+            stop = true;
+            got_signal = int(info.ssi_signo);
+          }
+        }
+      } else if (tfd == fd) {
+        uint64_t expirations;
+        if (sizeof(expirations) == read(tfd, &expirations, sizeof(expirations))) {
+          tick();
+          // a late tick (eg. after a suspend) is not made up for
+          const auto now = steady_clock::now();
+          if (deadline + interval < now) {
+            stats::overruns.inc();
+          }
+          deadline = std::max(deadline + interval, now);
+          arm(tfd, deadline);
+        }
+      } else if (mfd == fd) {
+        accept_scrapes(mfd, efd, scrapes);
+      } else if (scrapes.count(fd)) {
+        if (serve_scrape(efd, fd, scrapes[fd])) {
+          finish_scrape(fd);
+        }
+      } else {
+        for (size_t h = 0; h < hubs.size(); ++h) {
+          uint64_t count;
+          if (hubs[h].bus and hubs[h].bus->fd() == fd and sizeof(count) == read(fd, &count, sizeof(count))) {
+            check_bus(h);
+          }
         }
       }
     }
+
+    const auto now = steady_clock::now();
+    for (auto it = scrapes.begin(); it != scrapes.end();) {
+      const auto fd = it->first;
+      ++it;
+      if (scrapes[fd].deadline <= now) {
+        finish_scrape(fd);
+      }
+    }
+  }
+
+  while (not scrapes.empty()) {
+    finish_scrape(scrapes.begin()->first);
+  }
+
+  for (const auto fd : {sfd, tfd, efd, mfd}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  if (mfd >= 0) {
+    unlink(settings.metrics.c_str());
+  }
+
+  // the learned gaps were saved when calibrated, the runtime back-offs are
+  // not worth keeping
+  for (auto& h : hubs) {
+    if (h.bus) {
+      h.bus->stop();
+    }
   }
 
   if (got_signal) {
@@ -0,0 +1,26 @@
+#include "pid.hpp"
+
+#include <algorithm>
+
+pi::pi(double setpoint, double kp, double ki, double min, double max)
+  : setpoint(setpoint)
+  , kp(kp)
+  , ki(ki)
+  , min(min)
+  , max(max)
+  , integral(min)
+  , out(min)
+{}
+
+double pi::update(double temp, double dt) {
+  const auto error = temp - setpoint;
+  const auto candidate = integral + ki * error * dt;
+  const auto unclamped = kp * error + candidate;
+
+  if (not ((unclamped > max and error > 0) or (unclamped < min and error < 0))) {
+    integral = std::min(max, std::max(min, candidate));
+  }
+
+  out = std::min(max, std::max(min, kp * error + integral));
+  return out;
+}
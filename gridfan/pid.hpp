@@ -0,0 +1,31 @@
+#pragma once
+
+// A PI controller holding a temperature setpoint: the output (a fan speed
+// in percent) grows while the temperature is above the setpoint and
+// shrinks while it is below.
+// Anti-windup: the integral term stops accumulating while the output is
+// saturated in the direction the error pushes it, so that coming back
+// from a saturation does not take ages.
+
+class pi {
+public:
+
+  pi(double setpoint, double kp, double ki, double min, double max);
+
+  /**
+   * @brief feeds the controller with "temp", read "dt" seconds after the previous one
+   * @return the new output, within [min, max]
+   */
+  double update(double temp, double dt);
+
+  double output() const { return out; }
+
+private:
+  double setpoint;
+  double kp; // %/deg
+  double ki; // %/(deg*s)
+  double min;
+  double max;
+  double integral;
+  double out;
+};
@@ -1,114 +1,426 @@
 #include "temperature.hpp"
-#include <cassert>
+#include "metrics.hpp"
 #include <iostream>
 
-namespace temperature {
+#include <deque>
 
-  size_t monitor::ref_count = 0;
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sensors/sensors.h>
 
-  sensor::sensor( const sensors_chip_name* c, const sensors_feature* f )
-    : chip( c )
-    , fea( f )
-  {}
+namespace temperature {
 
-  double sensor::get( sensors_subfeature_type tp ) const 
+  // registered at load time like the bus metrics, read() never allocates them
+  namespace
   {
-    double value = 0.0;
-    const auto sub = sensors_get_subfeature( chip, fea, tp ); 
-
-    if( sub and ( sub->flags & SENSORS_MODE_R ) )
+    namespace stats
     {
-      const auto x = sensors_get_value(
-        chip, 
-        sub->number,
-        &value
-      );    
-
-      assert( 0 == x );
+      grid::metrics::histogram& read_latency = grid::metrics::get_histogram( "gridfan_sensor_read_seconds", "Time spent reading a snapshot of the sensors" );
+      grid::metrics::counter& errors = grid::metrics::get_counter( "gridfan_sensor_errors_total", "Failed sensor reads" );
     }
+  }
 
-    return value;
+  sensor::sensor( std::string l )
+    : label( std::move( l ) )
+  {}
+
+  bool sensor::read( double& value ) const noexcept
+  {
+    return get( field::input, value );
   }
 
   double sensor::temperature() const
   {
-    return get( SENSORS_SUBFEATURE_TEMP_INPUT );
+    double value = 0.0;
+    get( field::input, value );
+    return value;
   }
 
   double sensor::high() const
   {
-    return get( SENSORS_SUBFEATURE_TEMP_MAX );
+    double value = 0.0;
+    get( field::max, value );
+    return value;
   }
 
   double sensor::crit() const
   {
-    return get( SENSORS_SUBFEATURE_TEMP_CRIT );
+    double value = 0.0;
+    get( field::crit, value );
+    return value;
   }
 
-  std::string sensor::name() const
+  const std::string& sensor::name() const
   {
-    auto label = sensors_get_label( chip, fea );
+    return label;
+  }
 
-    if( label )
+  namespace
+  {
+    std::string label_of( const sensors_chip_name* chip, const sensors_feature* fea )
     {
-      std::string tmp( label );
+      auto label = sensors_get_label( chip, fea );
 
-      if( label != fea->name )
-        free( label );
+      if( label )
+      {
+        std::string tmp( label );
 
-      return tmp;
+        if( label != fea->name )
+          free( label );
+
+        return tmp;
+      }
+
+      return fea->name;
     }
 
-    return fea->name;
-  }
+    // a libsensors feature, the subfeatures are looked up once
+    class chip_sensor final : public sensor
+    {
+    public:
+      chip_sensor( const sensors_chip_name* c, const sensors_feature* f )
+        : sensor( label_of( c, f ) )
+        , chip( c )
+        , input( lookup( c, f, SENSORS_SUBFEATURE_TEMP_INPUT ) )
+        , max( lookup( c, f, SENSORS_SUBFEATURE_TEMP_MAX ) )
+        , critical( lookup( c, f, SENSORS_SUBFEATURE_TEMP_CRIT ) )
+      {}
 
-  static monitor* g_monitor = nullptr;
+    private:
+      // -1 when missing or not readable
+      static int lookup( const sensors_chip_name* c, const sensors_feature* f, sensors_subfeature_type tp )
+      {
+        const auto sub = sensors_get_subfeature( c, f, tp );
 
-  monitor::monitor() noexcept
-  {
-    if( 0 == ref_count++ )
+        return ( sub and ( sub->flags & SENSORS_MODE_R ) ) ? sub->number : -1;
+      }
+
+      bool get( field f, double& value ) const noexcept override
+      {
+        const auto number = ( field::input == f ) ? input : ( field::max == f ) ? max : critical;
+        double tmp;
+
+        if( number < 0 or 0 != sensors_get_value( chip, number, &tmp ) )
+          return false;
+
+        value = tmp;
+        return true;
+      }
+
+      const sensors_chip_name* chip;
+      int input;
+      int max;
+      int critical;
+    };
+
+    // libsensors is initialized once for all the backends using it
+    class libsensors final : public backend
     {
-      if( 0 != sensors_init( nullptr ) )
+    public:
+      libsensors() noexcept
+        : initialized( 0 == ref_count++ ? 0 == sensors_init( nullptr ) : true )
       {
-        ref_count = 0;
-        return;
+        if( not initialized )
+          ref_count = 0;
       }
 
-      g_monitor = this;
+      ~libsensors() noexcept
+      {
+        if( initialized and 0 == --ref_count )
+          sensors_cleanup();
+      }
+
+      bool ready() const noexcept override
+      {
+        return initialized;
+      }
+
+      const char* version() const noexcept override
+      {
+        return libsensors_version;
+      }
+
+      void enumerate( const std::function<bool( const sensor& )>& found ) override
+      {
+        int nr = 0;
+
+        for( auto chip = sensors_get_detected_chips( nullptr, &nr ); chip ; chip = sensors_get_detected_chips( nullptr, &nr ) )
+        {
+          int ft = 0;
+
+          for( auto feature = sensors_get_features( chip, &ft ); feature ; feature = sensors_get_features( chip, &ft ) )
+          {
+            if( SENSORS_FEATURE_TEMP != feature->type )
+              continue;
+
+            sensors.emplace_back( chip, feature );
+
+            if( not found( sensors.back() ) )
+              return;
+          }
+        }
+      }
+
+    private:
+      static size_t ref_count;
+      bool initialized;
+      std::deque<chip_sensor> sensors; // stable addresses
+    };
+
+    size_t libsensors::ref_count = 0;
+
+    // hwmon files hold millidegrees as a decimal integer
+    bool read_millidegrees( int fd, long& value )
+    {
+      char buffer[24];
+      const auto n = pread( fd, buffer, sizeof(buffer), 0 );
+
+      if( n <= 0 )
+        return false;
+
+      const char* p = buffer;
+      const char* end = buffer + n;
+      const bool negative = ( '-' == *p );
+      long x = 0;
+
+      if( negative )
+        ++p;
+
+      if( p == end or *p < '0' or *p > '9' )
+        return false;
+
+      for( ; p != end and *p >= '0' and *p <= '9'; ++p )
+        x = x * 10 + ( *p - '0' );
+
+      value = negative ? -x : x;
+      return true;
     }
 
-    int nr = 0;
+    // a sysfs hwmon temperature, the files (-1 when missing) are owned by the backend
+    class hwmon_sensor final : public sensor
+    {
+    public:
+      hwmon_sensor( std::string label, int in, int mx, int cr )
+        : sensor( std::move( label ) )
+        , input( in )
+        , max( mx )
+        , critical( cr )
+      {}
+
+    private:
+      bool get( field f, double& value ) const noexcept override
+      {
+        const auto fd = ( field::input == f ) ? input : ( field::max == f ) ? max : critical;
+        long millidegrees;
 
-    for( auto chip = sensors_get_detected_chips( nullptr, &nr ); chip ; chip = sensors_get_detected_chips( nullptr, &nr ) )
+        if( fd < 0 or not read_millidegrees( fd, millidegrees ) )
+          return false;
+
+        value = millidegrees / 1000.0;
+        return true;
+      }
+
+      int input;
+      int max;
+      int critical;
+    };
+
+    std::vector<std::string> entries( const std::string& path )
     {
-      int ft = 0;
+      std::vector<std::string> names;
+      auto dir = opendir( path.c_str() );
+
+      if( not dir )
+        return names;
+
+      while( auto e = readdir( dir ) )
+        if( '.' != e->d_name[0] )
+          names.emplace_back( e->d_name );
+
+      closedir( dir );
+      std::sort( names.begin(), names.end() );
+      return names;
+    }
+
+    std::string first_line( const std::string& path )
+    {
+      char buffer[128];
+      const auto fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+
+      if( fd < 0 )
+        return {};
 
-      for( auto feature = sensors_get_features( chip, &ft ); feature ; feature = sensors_get_features( chip, &ft ) )
+      const auto n = ::read( fd, buffer, sizeof(buffer) );
+      close( fd );
+
+      std::string line( buffer, n > 0 ? size_t( n ) : 0 );
+      return line.substr( 0, line.find( '\n' ) );
+    }
+
+    // matches "temp<N>_input"
+    bool temp_input( const std::string& name, unsigned& index )
+    {
+      static const std::string prefix = "temp", suffix = "_input";
+
+      if( name.size() <= prefix.size() + suffix.size()
+      or  0 != name.compare( 0, prefix.size(), prefix )
+      or  0 != name.compare( name.size() - suffix.size(), suffix.size(), suffix )
+      )
+        return false;
+
+      const auto digits = name.substr( prefix.size(), name.size() - prefix.size() - suffix.size() );
+
+      if( std::string::npos != digits.find_first_not_of( "0123456789" ) or digits.size() > 4 )
+        return false;
+
+      index = unsigned( std::stoul( digits ) );
+      return true;
+    }
+
+    class hwmon final : public backend
+    {
+    public:
+      explicit hwmon( const std::string& r ) noexcept
+        : root( r )
+        , exists( false )
       {
-        if( SENSORS_FEATURE_TEMP == feature->type )
+        if( auto dir = opendir( root.c_str() ) )
         {
-          sensors.emplace_back( chip, feature );
+          closedir( dir );
+          exists = true;
         }
       }
-    }
+
+      ~hwmon() noexcept
+      {
+        for( const auto fd : files )
+          close( fd );
+      }
+
+      bool ready() const noexcept override
+      {
+        return exists;
+      }
+
+      const char* version() const noexcept override
+      {
+        return "sysfs";
+      }
+
+      void enumerate( const std::function<bool( const sensor& )>& found ) override
+      {
+        for( const auto& chip : entries( root ) )
+        {
+          const auto path = root + "/" + chip + "/";
+          std::vector<unsigned> indexes;
+
+          for( const auto& name : entries( path ) )
+          {
+            unsigned index;
+
+            if( temp_input( name, index ) )
+              indexes.push_back( index );
+          }
+
+          std::sort( indexes.begin(), indexes.end() );
+
+          for( const auto index : indexes )
+          {
+            const auto prefix = path + "temp" + std::to_string( index );
+            const auto input = open( ( prefix + "_input" ).c_str(), O_RDONLY | O_CLOEXEC );
+
+            if( input < 0 )
+              continue;
+
+            const auto max = open( ( prefix + "_max" ).c_str(), O_RDONLY | O_CLOEXEC );
+            const auto crit = open( ( prefix + "_crit" ).c_str(), O_RDONLY | O_CLOEXEC );
+
+            for( const auto fd : { input, max, crit } )
+              if( fd >= 0 )
+                files.push_back( fd );
+
+            // same naming as libsensors: the label if any, the feature name otherwise
+            auto label = first_line( prefix + "_label" );
+
+            if( label.empty() )
+              label = "temp" + std::to_string( index );
+
+            sensors.emplace_back( std::move( label ), input, max, crit );
+
+            if( not found( sensors.back() ) )
+              return;
+          }
+        }
+      }
+
+    private:
+      const std::string root;
+      bool exists;
+      std::deque<hwmon_sensor> sensors; // stable addresses
+      std::vector<int> files;
+    };
+  }
+
+  std::unique_ptr<backend> libsensors_backend()
+  {
+    return std::unique_ptr<backend>( new libsensors() );
+  }
+
+  std::unique_ptr<backend> hwmon_backend( const std::string& root )
+  {
+    return std::unique_ptr<backend>( new hwmon( root ) );
+  }
+
+  static monitor* g_monitor = nullptr;
+
+  constexpr const char* monitor::hwmon_root;
+
+  bool monitor::add( const sensor& s, const std::vector<std::string>& wanted )
+  {
+    const auto& label = s.name();
+
+    if( index.emplace( label, sensors.size() ).second
+    and wanted.end() != std::find( wanted.begin(), wanted.end(), label ) )
+      --missing;
+
+    sensors.push_back( &s );
+    return wanted.empty() or missing;
+  }
+
+  // the amount of distinct labels in "wanted"
+  static size_t distinct( std::vector<std::string> wanted )
+  {
+    std::sort( wanted.begin(), wanted.end() );
+    return size_t( std::unique( wanted.begin(), wanted.end() ) - wanted.begin() );
+  }
+
+  monitor::monitor( std::unique_ptr<backend> b, const std::vector<std::string>& wanted ) noexcept
+    : source( std::move( b ) )
+    , missing( distinct( wanted ) )
+  {
+    if( not *this )
+      return;
+
+    if( not g_monitor )
+      g_monitor = this;
+
+    source->enumerate( [&]( const sensor& s ){ return add( s, wanted ); } );
   }
 
   monitor::operator bool() const {
-    return this == g_monitor;
+    return source and source->ready();
   }
 
   const char* monitor::version() const
   {
-    return libsensors_version;
+    return source ? source->version() : "none";
   }
 
   monitor::~monitor() noexcept
   {
-    if( ref_count and 0 == --ref_count )
-    {
-      sensors_cleanup();
+    if( this == g_monitor )
       g_monitor = nullptr;
-    }
   }
   
   size_t monitor::size() const  noexcept
@@ -117,20 +429,40 @@ namespace temperature {
   { return sensors.empty(); }
 
   const sensor& monitor::operator [] ( size_t index ) const
-  { return sensors[ index ]; }
+  { return *sensors[ index ]; }
 
-  sensor& monitor::operator [] ( size_t index )
-  { return sensors[ index ]; }
-
-  monitor::iterator monitor::begin() noexcept
-  { return sensors.begin(); }
-  monitor::iterator monitor::end() noexcept
-  { return sensors.end(); }
   monitor::const_iterator monitor::begin() const noexcept
   { return sensors.begin(); }
   monitor::const_iterator monitor::end() const noexcept
   { return sensors.end(); }
 
+  snapshot monitor::prepare( std::vector<const sensor*> chosen ) const
+  {
+    snapshot s;
+    const auto n = chosen.size();
+
+    s.sensors = std::move( chosen );
+    s.values.assign( n, 0.0 );
+    s.times.assign( n, snapshot::clock::time_point() );
+    s.valid.assign( n, 0 );
+    return s;
+  }
+
+  void monitor::read( snapshot& s ) const noexcept
+  {
+    const grid::metrics::timer timer( stats::read_latency );
+    s.taken = snapshot::clock::now();
+
+    for( size_t i = 0; i < s.sensors.size(); ++i )
+    {
+      s.valid[ i ] = s.sensors[ i ]->read( s.values[ i ] );
+      s.times[ i ] = snapshot::clock::now();
+
+      if( not s.valid[ i ] )
+        stats::errors.inc();
+    }
+  }
+
   monitor& global_monitor() noexcept
   {
     return *g_monitor;
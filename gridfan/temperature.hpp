@@ -3,28 +3,79 @@
 
 #include <vector>
 #include <string>
+#include <chrono>
+#include <cstdint>
 #include <algorithm>
-#include <sensors/sensors.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
 
 namespace temperature {
 
+  // A temperature sensor, as found by one of the backends.
   class sensor {
   public:
-    sensor( const sensors_chip_name* c, const sensors_feature* f );
+    virtual ~sensor() = default;
     double temperature() const;
     double high() const;
     double crit() const;
-    std::string name() const;
+    const std::string& name() const;
+
+    /**
+     * @brief reads the current temperature into "value"
+     * @return false if it could not be read, "value" is left untouched
+     */
+    bool read( double& value ) const noexcept;
+  protected:
+    enum class field { input, max, crit };
+    explicit sensor( std::string label );
+    // reads "f" into "value", false when missing or not readable
+    virtual bool get( field f, double& value ) const noexcept = 0;
   private:
-    double get( sensors_subfeature_type tp ) const;
-    const sensors_chip_name* chip;
-    const sensors_feature* fea;
+    std::string label;
+  };
+
+  // Where the sensors come from: libsensors, or the sysfs hwmon class read
+  // directly. A backend owns the sensors it finds, they live as long as it.
+  class backend {
+  public:
+    virtual ~backend() = default;
+    // false if the backend could not be set up
+    virtual bool ready() const noexcept = 0;
+    virtual const char* version() const noexcept = 0;
+    // passes the temperature sensors to "found" until it returns false
+    virtual void enumerate( const std::function<bool( const sensor& )>& found ) = 0;
+  };
+
+  std::unique_ptr<backend> libsensors_backend();
+
+  // "root"/*/temp*_input are opened once and kept open
+  std::unique_ptr<backend> hwmon_backend( const std::string& root );
+
+  // The readings of a fixed set of sensors, taken in one pass by
+  // monitor::read(). The arrays are allocated once by monitor::prepare(),
+  // entry N of every array refers to sensors[N].
+  struct snapshot {
+    typedef std::chrono::steady_clock clock;
+
+    std::vector<const sensor*> sensors;
+    std::vector<double> values;            // degrees
+    std::vector<clock::time_point> times;  // when each value was read
+    std::vector<uint8_t> valid;            // 0 if the last read failed
+    clock::time_point taken;               // when the last pass started
+
+    size_t size() const noexcept { return sensors.size(); }
   };
 
   class monitor final {
   public:
 
-    monitor() noexcept;
+    static constexpr const char* hwmon_root = "/sys/class/hwmon";
+
+    // The sensors of "source" are enumerated until all the "wanted" labels
+    // are found, an empty list means every sensor.
+    explicit monitor( std::unique_ptr<backend> source, const std::vector<std::string>& wanted = {} ) noexcept;
+
     ~monitor() noexcept;
 
     explicit operator bool() const;
@@ -34,29 +85,40 @@ namespace temperature {
     size_t size() const noexcept;
     bool empty() const noexcept;
 
-    typedef std::vector<sensor>::iterator iterator;
-    typedef std::vector<sensor>::const_iterator const_iterator;
+    typedef std::vector<const sensor*>::const_iterator const_iterator;
 
     const sensor& operator [] ( size_t ) const;
-    sensor& operator [] ( size_t );
 
-    iterator begin() noexcept;
-    iterator end() noexcept;
     const_iterator begin() const noexcept;
     const_iterator end() const noexcept;
 
-    inline const_iterator find(const std::string& name) const {
-      return std::find_if(
-          begin(),
-          end(),
-            [&name](const auto& sensor){
-            return sensor.name() == name;
-        });
+    /**
+     * @brief a snapshot of "chosen", ready to be filled by read()
+     */
+    snapshot prepare( std::vector<const sensor*> chosen ) const;
+
+    /**
+     * @brief reads every sensor of "s" in one pass, without allocating
+     */
+    void read( snapshot& s ) const noexcept;
+
+    // the first sensor labelled "name", nullptr if none
+    inline const sensor* find(const std::string& name) const {
+      const auto it = index.find(name);
+      return (index.end() == it) ? nullptr : sensors[it->second];
     }
 
   private:
-    static size_t ref_count;
-    std::vector<sensor> sensors;
+    monitor( const monitor& ) = delete;
+    monitor& operator = ( const monitor& ) = delete;
+
+    // appends "s" and indexes it, false once all the wanted labels are found
+    bool add( const sensor& s, const std::vector<std::string>& wanted );
+
+    std::unique_ptr<backend> source;
+    std::vector<const sensor*> sensors;
+    std::unordered_map<std::string, size_t> index; // label -> position in "sensors"
+    size_t missing; // wanted labels not found yet
   };
 
   monitor& global_monitor() noexcept;
@@ -0,0 +1,110 @@
+#include "zone.hpp"
+
+#include <algorithm>
+#include <limits>
+
+zone::zone(const config::zone& cfg, std::vector<size_t> sensors)
+  : cfg(cfg)
+  , sensors(std::move(sensors))
+  , pi_curve("pi" == cfg.curve)
+  , controller(cfg.setpoint, cfg.kp, cfg.ki, cfg.min_speed, cfg.max_speed)
+  , table(::curve::builtin(cfg.curve))
+{
+  if ("table" == cfg.curve) {
+    owned = std::make_shared<::curve::table>(cfg.points);
+    table = owned.get();
+  } else if (not table) {
+    table = ::curve::builtin("linear");
+  }
+}
+
+double zone::temperature(const temperature::snapshot& readings) const {
+  double t = -273.15;
+  bool any = false;
+  for (const auto i : sensors) {
+    if (readings.valid[i]) {
+      t = std::max(t, readings.values[i]);
+      any = true;
+    }
+  }
+  return any ? t : std::numeric_limits<double>::quiet_NaN();
+}
+
+int zone::curve(double temp) const {
+  return table->percent(int32_t(temp * 1000));
+}
+
+bool zone::settled() const {
+  if (failing) {
+    return false;
+  }
+  if (pi_curve) {
+    return last_p >= 0 and grid::fan::raw(last_curve) == grid::fan::raw(last_p);
+  }
+  return last_p >= 0 and last_curve <= last_p and last_p - last_curve <= 5;
+}
+
+bool zone::fail_safe() {
+  static constexpr int full = 100;
+
+  failing = true;
+  last_curve = full;
+
+  if (full == last_p) {
+    return false;
+  }
+
+  last_p = full;
+  return true;
+}
+
+bool zone::update(double temp, double dt) {
+  failing = false;
+  return pi_curve ? update_pi(temp, dt) : update_table(temp);
+}
+
+bool zone::update_pi(double temp, double dt) {
+  const auto p = int(controller.update(temp, dt) + 0.5);
+  last_curve = p;
+
+  if (last_p < 0) {
+    last_p = p;
+    return true;
+  }
+
+  // the hub only has a few voltage levels, a new target is worth sending
+  // only if it lands on another level, and by a couple percent at least
+  // so that an output sitting on the edge of two levels does not hop
+  const auto level = grid::fan::raw(last_p);
+  const auto margin = (p > last_p) ? -2 : 2;
+
+  if (grid::fan::raw(p) != level and grid::fan::raw(p + margin) != level) {
+    last_p = p;
+    return true;
+  }
+
+  return false;
+}
+
+bool zone::update_table(double temp) {
+  const auto p = curve(temp);
+  last_curve = p;
+
+  // changes in fan speed are triggered only if either
+  // - desired speed is higher than current speed
+  //                     or
+  // - desired speed is "way" lower than current speed (5%)
+
+  if (p > last_p or last_p - p > 5) {
+    // if desired speed is lower than current speed, slowly decrease it
+    // at a maximum rate of -10% per tick
+    if (p < last_p) {
+      last_p = std::max(p, last_p - 10);
+    } else {
+      last_p = p;
+    }
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "curve.hpp"
+#include "pid.hpp"
+#include "temperature.hpp"
+#include "libgridfan.hpp"
+
+// A thermal zone: a group of fans driven by the hottest of a group of
+// sensors through the zone own curve. The sensors are entries of the
+// snapshot the daemon takes once per tick.
+// The curve is either a lookup table mapping temperature to speed (a
+// built-in one or one made of the configured points) or a PI controller
+// holding a setpoint; the latter only changes the target when the raw
+// voltage level the hub would be set to changes.
+
+class zone {
+public:
+
+  zone(const config::zone& cfg, std::vector<size_t> sensors);
+
+  const std::string& name() const { return cfg.name; }
+  const std::vector<config::fan>& fans() const { return cfg.fans; }
+
+  /**
+   * @brief the hottest of the zone sensors in "readings", the failed reads
+   * are ignored; NaN if none of them could be read
+   */
+  double temperature(const temperature::snapshot& readings) const;
+
+  /**
+   * @brief the speed the curve table maps "temp" to
+   */
+  int curve(double temp) const;
+
+  /**
+   * @brief feeds the zone with a new temperature, read "dt" seconds after the previous one
+   * @return true if the zone target changed and must be sent to its fans
+   */
+  bool update(double temp, double dt = 1.0);
+
+  /**
+   * @brief runs the fans at full speed, for when none of the zone sensors
+   * can be read: the zone is blind until the next update()
+   * @return true if the zone target changed and must be sent to its fans
+   */
+  bool fail_safe();
+
+  /**
+   * @brief true between fail_safe() and the next update()
+   */
+  bool blind() const { return failing; }
+
+  /**
+   * @brief the current speed target, -1 before the first update
+   */
+  int target() const { return last_p; }
+
+  /**
+   * @brief true if feeding the last temperature again would not change the
+   * target, never while blind
+   */
+  bool settled() const;
+
+private:
+  config::zone cfg;
+  std::vector<size_t> sensors; // positions in the snapshot
+  bool pi_curve;               // resolved once, cfg.curve is not looked at per tick
+  int last_p = -1;
+  int last_curve = -1; // what the curve mapped the last temperature to
+  bool failing = false;
+  pi controller;
+  std::shared_ptr<const ::curve::table> owned; // the configured table, if any
+  const ::curve::table* table;
+
+  bool update_table(double temp);
+  bool update_pi(double temp, double dt);
+};
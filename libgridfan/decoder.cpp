@@ -0,0 +1,100 @@
+#include "decoder.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace grid
+{
+  constexpr size_t decoder::capacity;
+
+  // registered when the library is loaded, see libgridfan.cpp
+  static metrics::counter& discarded_bytes = metrics::get_counter( "gridfan_bus_discarded_bytes_total", "Received bytes that were not part of any reply" );
+
+  decoder::decoder() noexcept
+    : begin( 0 )
+    , end( 0 )
+    , header( nullptr )
+    , header_size( 0 )
+    , size( 0 )
+    , skipped( 0 )
+  {}
+
+  void decoder::expect( const uint8_t* h, size_t hs, size_t s ) noexcept
+  {
+    skip( end - begin );
+    header = h;
+    header_size = hs;
+    size = std::min( s, capacity );
+  }
+
+  uint8_t* decoder::space() noexcept
+  {
+    // the unconsumed bytes are moved to the front, so that a whole reply always fits
+    if( begin == end )
+    {
+      begin = end = 0;
+    }
+    else if( begin > 0 )
+    {
+      std::memmove( buffer, buffer + begin, end - begin );
+      end -= begin;
+      begin = 0;
+    }
+
+    return buffer + end;
+  }
+
+  size_t decoder::room() const noexcept
+  {
+    return capacity - end;
+  }
+
+  void decoder::commit( size_t count ) noexcept
+  {
+    end = std::min( capacity, end + count );
+  }
+
+  bool decoder::next( uint8_t* out ) noexcept
+  {
+    while( begin < end )
+    {
+      // a partial header is good enough, the rest of it is on its way
+      const auto n = std::min( header_size, end - begin );
+
+      if( 0 == n or 0 == std::memcmp( buffer + begin, header, n ) )
+      {
+        if( end - begin < size )
+          return false;
+
+        std::memcpy( out, buffer + begin, size );
+        begin += size;
+        return true;
+      }
+
+      skip( 1 );
+    }
+
+    return false;
+  }
+
+  size_t decoder::buffered() const noexcept
+  {
+    return end - begin;
+  }
+
+  uint64_t decoder::discarded() const noexcept
+  {
+    return skipped;
+  }
+
+  void decoder::skip( size_t count ) noexcept
+  {
+    if( 0 == count )
+      return;
+
+    discarded_bytes.inc( count );
+    skipped += count;
+    begin += count;
+  }
+}
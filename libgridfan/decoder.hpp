@@ -0,0 +1,75 @@
+#ifndef LIBGRIDFAN_DECODER_H
+#define LIBGRIDFAN_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace grid
+{
+  /**
+   * @brief frames the hub replies out of the received byte stream.
+   * The bytes read from the line are appended to a fixed receive buffer and
+   * next() looks there for the reply to the outstanding command: a fixed
+   * size frame starting with a known header. Whatever cannot start it
+   * (noise, the tail of a late reply) is skipped a byte at a time, so a
+   * stray byte costs a few bytes of scanning instead of misaligning every
+   * later reply. Skipped bytes are counted.
+   */
+  class decoder
+  {
+  public:
+
+    static constexpr size_t capacity = 64;
+
+    decoder() noexcept;
+
+    /**
+     * @brief starts looking for a "size" bytes reply starting with the
+     * "header_size" bytes of "header", which must outlive the search;
+     * whatever is still buffered belongs to no command and is discarded
+     */
+    void expect( const uint8_t* header, size_t header_size, size_t size ) noexcept;
+
+    /**
+     * @brief where to store the next bytes read from the line, room() of
+     * them at most once space() was called
+     */
+    uint8_t* space() noexcept;
+    size_t room() const noexcept;
+
+    /**
+     * @brief appends the "count" bytes just stored at space()
+     */
+    void commit( size_t count ) noexcept;
+
+    /**
+     * @brief skips the bytes that cannot start the reply
+     * @return true once the whole reply is buffered, it is then copied to "out" and consumed
+     */
+    bool next( uint8_t* out ) noexcept;
+
+    /**
+     * @brief the bytes buffered and not consumed yet
+     */
+    size_t buffered() const noexcept;
+
+    /**
+     * @brief the amount of bytes skipped so far
+     */
+    uint64_t discarded() const noexcept;
+
+  private:
+
+    void skip( size_t count ) noexcept;
+
+    uint8_t buffer[ capacity ];
+    size_t begin;
+    size_t end;
+    const uint8_t* header;
+    size_t header_size;
+    size_t size;
+    uint64_t skipped;
+  };
+}
+
+#endif // LIBGRIDFAN_DECODER_H
@@ -0,0 +1,417 @@
+#include "engine.hpp"
+#include "serial.hpp"
+#include "trace.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+GRID_TRACE_PROBE( engine_pace )
+
+namespace serial
+{
+  static const line_metrics line = {
+    grid::metrics::get_histogram( "gridfan_serial_write_seconds", "Time spent writing to the serial line" ),
+    grid::metrics::get_counter( "gridfan_serial_errors_total{op=\"write\",kind=\"error\"}", "Failed serial line operations" ),
+    grid::metrics::get_histogram( "gridfan_serial_read_seconds", "Time spent waiting for serial line replies" ),
+    grid::metrics::get_counter( "gridfan_serial_errors_total{op=\"read\",kind=\"timeout\"}", "Failed serial line operations" ),
+    grid::metrics::get_counter( "gridfan_serial_errors_total{op=\"read\",kind=\"error\"}", "Failed serial line operations" ),
+  };
+
+  const line_metrics& line_stats() noexcept
+  {
+    return line;
+  }
+
+  engine::engine( serial_t h ) noexcept
+    : handle( h )
+    , epoll( -1 )
+    , timer( -1 )
+    , state( phase::idle )
+    , tx_done( 0 )
+    , rx_done( 0 )
+    , completed( 0 )
+    , watching( 0 )
+    , hangup( false )
+    , sync( nullptr )
+  {
+    if( INVALID_SERIAL == handle )
+      return;
+
+    epoll = epoll_create1( EPOLL_CLOEXEC );
+    timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = timer;
+
+    if( -1 == epoll or -1 == timer or 0 != epoll_ctl( epoll, EPOLL_CTL_ADD, timer, &ev ) )
+    {
+      const auto err = errno;
+      close();
+      errno = err;
+      return;
+    }
+
+    watch( 0 );
+  }
+
+  engine::~engine() noexcept
+  {
+    close();
+  }
+
+  engine::operator bool () const noexcept
+  {
+    return INVALID_SERIAL != handle;
+  }
+
+  int engine::fd() const noexcept
+  {
+    return epoll;
+  }
+
+  void engine::close() noexcept
+  {
+    serial_close( handle );
+    handle = INVALID_SERIAL;
+
+    if( -1 != timer )
+      ::close( timer );
+    if( -1 != epoll )
+      ::close( epoll );
+
+    timer = epoll = -1;
+    watching = 0;
+
+    // whatever is still queued is not going to complete
+    while( phase::idle != state or not queue.empty() )
+    {
+      if( phase::idle == state )
+        start();
+      else
+        finish( status::error, EBADF );
+    }
+  }
+
+  void engine::submit( request r )
+  {
+    queue.push_back( std::move( r ) );
+
+    if( phase::idle == state )
+      start();
+  }
+
+  std::future<engine::completion> engine::async( request r )
+  {
+    auto promise = std::make_shared<std::promise<completion>>();
+    r.done = [promise]( const completion& c ){ promise->set_value( c ); };
+    submit( std::move( r ) );
+    return promise->get_future();
+  }
+
+  size_t engine::process( const std::chrono::milliseconds& wait )
+  {
+    completed = 0;
+
+    if( -1 == epoll )
+      return 0;
+
+    struct epoll_event events[2];
+    const int ms = ( infinite == wait ) ? -1 : int( wait.count() );
+    const int n = epoll_wait( epoll, events, 2, ms );
+
+    for( int i = 0; i < n; ++i )
+    {
+      if( timer == events[i].data.fd )
+      {
+        uint64_t expirations;
+        if( sizeof(expirations) == ::read( timer, &expirations, sizeof(expirations) ) )
+          on_timer();
+      }
+      else if( events[i].data.fd == handle )
+      {
+        if( phase::writing == state and ( events[i].events & EPOLLOUT ) )
+          on_writable();
+        else if( phase::reading == state )
+          on_readable();
+        else if( not ( events[i].events & ( EPOLLHUP | EPOLLERR ) ) )
+          continue;
+        else if( phase::idle == state )
+        {
+          hangup = true;
+          watch( 0 );
+        }
+        else
+          finish( status::error, EIO );
+      }
+    }
+
+    return completed;
+  }
+
+  engine::completion engine::run( request r )
+  {
+    completion result = { status::error, 0, 0 };
+    r.done = nullptr;
+
+    if( idle() )
+    {
+      // no queue node and no callback: the reply goes straight to "result"
+      current = std::move( r );
+      sync = &result;
+      begin();
+
+      while( &result == sync )
+        process( infinite );
+
+      return result;
+    }
+
+    bool done = false;
+    r.done = [&]( const completion& c ){ result = c; done = true; };
+    submit( std::move( r ) );
+
+    while( not done )
+      process( infinite );
+
+    return result;
+  }
+
+  bool engine::flush() noexcept
+  {
+    return INVALID_SERIAL != handle and serial_flush( handle );
+  }
+
+  bool engine::idle() const noexcept
+  {
+    return phase::idle == state and queue.empty();
+  }
+
+  size_t engine::pending() const noexcept
+  {
+    return queue.size() + ( phase::idle == state ? 0 : 1 );
+  }
+
+  bool engine::hung_up() const noexcept
+  {
+    return hangup;
+  }
+
+  engine::clock::time_point engine::get_last_read() const noexcept
+  {
+    return last_read;
+  }
+
+  engine::clock::time_point engine::get_last_write() const noexcept
+  {
+    return last_write;
+  }
+
+  void engine::start()
+  {
+    if( queue.empty() )
+    {
+      state = phase::idle;
+      return;
+    }
+
+    current = std::move( queue.front() );
+    queue.pop_front();
+    begin();
+  }
+
+  void engine::begin()
+  {
+    tx_done = rx_done = 0;
+
+    if( INVALID_SERIAL == handle )
+    {
+      state = phase::writing;
+      finish( status::error, EBADF );
+      return;
+    }
+
+    const auto not_before = std::max( last_read, last_write ) + current.gap;
+
+    if( current.tx_size and not_before > clock::now() )
+    {
+      GRID_TRACE( engine_pace,
+        current.tx_size > 1 ? static_cast<const uint8_t*>( current.tx )[1] : 0,
+        static_cast<const uint8_t*>( current.tx )[0],
+        std::chrono::duration_cast<std::chrono::nanoseconds>( not_before - clock::now() ).count() );
+
+      state = phase::pacing;
+      arm( not_before );
+      return;
+    }
+
+    begin_write();
+  }
+
+  void engine::begin_write()
+  {
+    if( 0 == current.tx_size )
+    {
+      begin_read();
+      return;
+    }
+
+    state = phase::writing;
+    on_writable();
+  }
+
+  void engine::begin_read()
+  {
+    if( 0 == current.rx_size or nullptr == current.rx )
+    {
+      finish( status::ok, 0 );
+      return;
+    }
+
+    state = phase::reading;
+
+    if( infinite != current.timeout )
+    {
+      deadline = clock::now() + current.timeout;
+      arm( deadline );
+    }
+
+    watch( EPOLLIN );
+
+    // the reply might be there already
+    on_readable();
+  }
+
+  void engine::on_timer()
+  {
+    switch( state )
+    {
+      case phase::pacing:
+        arm( {} );
+        begin_write();
+        break;
+      case phase::reading:
+        if( clock::now() >= deadline )
+          finish( status::timeout, ETIME );
+        break;
+      default:
+        break;
+    }
+  }
+
+  void engine::on_writable()
+  {
+    size_t count = current.tx_size - tx_done;
+
+    if( not serial_write_some( handle, static_cast<const uint8_t*>( current.tx ) + tx_done, &count ) )
+    {
+      finish( status::error, errno );
+      return;
+    }
+
+    tx_done += count;
+    last_write = clock::now();
+
+    if( tx_done == current.tx_size )
+    {
+      watch( 0 );
+      begin_read();
+    }
+    else
+    {
+      watch( EPOLLOUT );
+    }
+  }
+
+  void engine::on_readable()
+  {
+    size_t count = current.rx_size - rx_done;
+    errno = 0;
+
+    if( not serial_read( handle, static_cast<uint8_t*>( current.rx ) + rx_done, &count, NO_TIMEOUT ) )
+    {
+      // a hung up line reads 0 bytes without EAGAIN
+      finish( status::error, errno ? errno : EIO );
+      return;
+    }
+
+    if( 0 == count )
+      return;
+
+    rx_done += count;
+    last_read = clock::now();
+
+    if( rx_done == current.rx_size or not current.rx_all )
+      finish( status::ok, 0 );
+  }
+
+  void engine::finish( enum status st, int error )
+  {
+    arm( {} );
+    watch( 0 );
+
+    const completion c = { st, rx_done, error };
+    auto done = std::move( current.done );
+    current = request();
+    state = phase::idle;
+    ++completed;
+
+    if( sync )
+    {
+      *sync = c;
+      sync = nullptr;
+    }
+    else if( done )
+      done( c );
+
+    // the callback might have started a new request already
+    if( phase::idle == state )
+      start();
+  }
+
+  void engine::watch( uint32_t events )
+  {
+    // an idle handle is only watched for hang ups and errors (always
+    // reported by epoll), edge triggered so that a hung up line does not
+    // wake up the epoll set continuously; once seen it is not watched at all
+    if( 0 == events and not hangup )
+      events = EPOLLET;
+
+    if( -1 == epoll or events == watching )
+      return;
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = handle;
+
+    if( 0 == events )
+      epoll_ctl( epoll, EPOLL_CTL_DEL, handle, &ev );
+    else
+      epoll_ctl( epoll, watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, handle, &ev );
+
+    watching = events;
+  }
+
+  void engine::arm( clock::time_point when )
+  {
+    if( -1 == timer )
+      return;
+
+    struct itimerspec spec = {};
+
+    if( clock::time_point() != when )
+    {
+      // steady_clock is CLOCK_MONOTONIC, a deadline in the past fires immediately
+      const auto ns = std::max<int64_t>( 1, std::chrono::duration_cast<std::chrono::nanoseconds>( when.time_since_epoch() ).count() );
+      spec.it_value.tv_sec = time_t( ns / 1000000000 );
+      spec.it_value.tv_nsec = long( ns % 1000000000 );
+    }
+
+    timerfd_settime( timer, TFD_TIMER_ABSTIME, &spec, nullptr );
+  }
+}
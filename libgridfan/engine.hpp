@@ -0,0 +1,146 @@
+#ifndef SERIAL_ENGINE_HPP
+#define SERIAL_ENGINE_HPP
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+
+#include "serial.h"
+
+namespace serial
+{
+  static constexpr auto infinite = std::chrono::milliseconds::max();
+
+  /**
+   * @brief non-blocking, epoll based, request/response engine.
+   * It owns the serial handle and runs one request at a time: wait for the
+   * line to be idle for the requested gap, write the command, collect the
+   * reply, then report the completion and move to the next queued request.
+   * fd() can be added to any epoll/poll set, process() must be called
+   * whenever it becomes readable.
+   * @note an engine is not thread safe, it must be driven by a single thread.
+   */
+  class engine
+  {
+  public:
+
+    using clock = std::chrono::steady_clock;
+
+    enum class status { ok, error, timeout };
+
+    struct completion
+    {
+      enum status status;
+      size_t amount; // the amount of bytes read
+      int error;     // errno, in case of failure
+    };
+
+    typedef std::function<void( const completion& )> callback;
+
+    struct request
+    {
+      const void* tx = nullptr;  // the data to write, if any
+      size_t tx_size = 0;
+      void* rx = nullptr;        // where to store the reply, if any
+      size_t rx_size = 0;
+      bool rx_all = true;        // wait for rx_size bytes or complete on the first ones
+      std::chrono::microseconds gap = {}; // how long the line must be idle before writing
+      std::chrono::milliseconds timeout = infinite; // reply timeout
+      callback done;
+    };
+
+    explicit engine( serial_t handle ) noexcept;
+    ~engine() noexcept;
+
+    explicit operator bool () const noexcept;
+
+    /**
+     * @brief the epoll descriptor driving the engine, it becomes readable
+     * when there is something for process() to do
+     */
+    int fd() const noexcept;
+
+    void close() noexcept;
+
+    /**
+     * @brief discards the input received and not read yet (see serial_flush())
+     * @note only meaningful while idle()
+     */
+    bool flush() noexcept;
+
+    /**
+     * @brief queues "r", its callback is invoked from within process()
+     */
+    void submit( request r );
+
+    /**
+     * @brief queues "r" and returns a future resolved on completion,
+     * "r.done" is ignored
+     */
+    std::future<completion> async( request r );
+
+    /**
+     * @brief handles the pending events waiting at most "wait" for them
+     * @return the amount of completed requests
+     */
+    size_t process( const std::chrono::milliseconds& wait = std::chrono::milliseconds::zero() );
+
+    /**
+     * @brief submits "r" and processes events until it completes, "r.done"
+     * is ignored.
+     * An idle engine runs "r" right away in place of the queue, without
+     * allocating; otherwise "r" waits for the queued requests.
+     */
+    completion run( request r );
+
+    bool idle() const noexcept;
+    size_t pending() const noexcept;
+
+    /**
+     * @brief true once the line hung up or failed while idle, eg. the
+     * device went away, process() has to be called to notice it
+     */
+    bool hung_up() const noexcept;
+
+    clock::time_point get_last_read() const noexcept;
+    clock::time_point get_last_write() const noexcept;
+
+  private:
+
+    engine( const engine& ) = delete;
+    engine& operator = ( const engine& ) = delete;
+
+    enum class phase { idle, pacing, writing, reading };
+
+    void start();
+    void begin();
+    void begin_write();
+    void begin_read();
+    void on_timer();
+    void on_readable();
+    void on_writable();
+    void finish( enum status st, int error );
+    void watch( uint32_t events );
+    void arm( clock::time_point when );
+
+    serial_t handle;
+    int epoll;
+    int timer;
+
+    std::deque<request> queue;
+    request current;
+    enum phase state;
+    size_t tx_done;
+    size_t rx_done;
+    size_t completed;
+    uint32_t watching;
+    bool hangup;
+    completion* sync; // where the reply of the running run() goes
+    clock::time_point deadline;
+    clock::time_point last_read;
+    clock::time_point last_write;
+  };
+}
+
+#endif // SERIAL_ENGINE_HPP
@@ -1,4 +1,6 @@
 #include "libgridfan.hpp"
+#include "metrics.hpp"
+#include "trace.h"
 
 #include <iostream>
 #include <algorithm>
@@ -6,21 +8,404 @@
 #include <thread>
 #include <algorithm>
 #include <chrono>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <utility>
 
 #include <iomanip>
+#include <dirent.h>
+
+GRID_TRACE_PROBE( pace_entry )
+GRID_TRACE_PROBE( pace_return )
+GRID_TRACE_PROBE( init_retry )
 
 namespace grid {
 
-  static constexpr auto delay_between_access = 50ms;
   static constexpr uint8_t PING        = 0xC0;
   static constexpr uint8_t PING_OK     = 0x21;
   static constexpr uint8_t GET_UNKN1   = 0x84;
   static constexpr uint8_t GET_UNKN2   = 0x85;
   static constexpr uint8_t GET_RPM     = 0x8A;
   static constexpr uint8_t SET_VOLTAGE = 0x44;
+  static constexpr uint8_t SET_OK      = 0x01;
+
+  // la velocita' va da 0 a 12
+  // non puo' essere maggiore di 0 e minore di 4
+  // quindi se == 1 lo trasformo in zero
+  // se 2 o 3 lo trasformo in 4
+
+  static uint8_t percent_to_raw( int pr )
+  {
+    uint8_t raw = uint8_t( 4 + std::min( 8, ( pr - 20 ) * 8 / 75 ) );
+
+    if( raw < 4 ) raw = 4;
+    if( raw < 2 ) raw = 0;
+
+    return raw;
+  }
+
+  // a command together with room for its reply
+  struct frame
+  {
+    uint8_t request[7];
+    size_t request_size;
+    uint8_t answer[5];
+    size_t answer_size;
+  };
+
+  static frame encode( uint8_t cmd, uint8_t id, uint8_t raw = 0 )
+  {
+    frame f = { { cmd, id, 0, 0, 0, 0, 0 }, 2, {}, 5 };
+
+    switch( cmd )
+    {
+      case PING:
+        f.request_size = f.answer_size = 1;
+        break;
+      case SET_VOLTAGE:
+        f.request[2] = 0xc0;
+        f.request[5] = raw;
+        f.request_size = 7;
+        f.answer_size = 1;
+        break;
+    }
+
+    return f;
+  }
+
+  // the bytes every reply to "cmd" starts with
+  static size_t reply_header( uint8_t cmd, const uint8_t*& header )
+  {
+    static const uint8_t value[] = { 0xc0, 0x00, 0x00 };
+
+    switch( cmd )
+    {
+      case PING:        header = &PING_OK; return 1;
+      case SET_VOLTAGE: header = &SET_OK; return 1;
+    }
+
+    header = value;
+    return sizeof(value);
+  }
+
+  static controller::result_t validate( uint8_t cmd, const uint8_t* answer )
+  {
+    switch( cmd )
+    {
+      case PING:
+        return ( answer[0] == PING_OK ) ? controller::result_t::ok : controller::result_t::invalid_data;
+      case SET_VOLTAGE:
+        return ( answer[0] == SET_OK ) ? controller::result_t::ok : controller::result_t::invalid_data;
+    }
+
+    // The reply should be something like "C0 00 00 02 76".
+    //   "C0 00 00" is always the same and the last two bytes are the value in hex.
+    if( answer[0] != 0xc0
+    or  answer[1] != 0x00
+    or  answer[2] != 0x00
+    )
+      return controller::result_t::invalid_data;
+
+    return controller::result_t::ok;
+  }
+
+  static void back_off( controller::result_t result, std::chrono::microseconds& gap )
+  {
+    if( controller::result_t::timeout == result or controller::result_t::invalid_data == result )
+    {
+      const auto err = errno;
+      timings::back_off( gap );
+      errno = err;
+    }
+  }
+
+  // The bus metrics are registered when the library is loaded rather than
+  // on first use, so that the bus calls (the noexcept ones included) never
+  // allocate them.
+  namespace
+  {
+    namespace stats
+    {
+      using metrics::get_counter;
+      using metrics::get_histogram;
+
+      const char* const commands_help = "Bus transactions";
+      const char* const errors_help = "Failed bus transactions";
+
+      metrics::counter& pings = get_counter( "gridfan_bus_commands_total{cmd=\"ping\"}", commands_help );
+      metrics::counter& gets = get_counter( "gridfan_bus_commands_total{cmd=\"get\"}", commands_help );
+      metrics::counter& sets = get_counter( "gridfan_bus_commands_total{cmd=\"set\"}", commands_help );
+      metrics::counter& timeouts = get_counter( "gridfan_bus_errors_total{kind=\"timeout\"}", errors_help );
+      metrics::counter& invalid = get_counter( "gridfan_bus_errors_total{kind=\"unexpected_data\"}", errors_help );
+      metrics::counter& io = get_counter( "gridfan_bus_errors_total{kind=\"io_error\"}", errors_help );
+      metrics::histogram& get_latency = get_histogram( "gridfan_bus_get_seconds", "GET_* transactions duration, pacing included" );
+      metrics::histogram& set_latency = get_histogram( "gridfan_bus_set_seconds", "SET_VOLTAGE transactions duration, pacing included" );
+      metrics::counter& skipped = get_counter( "gridfan_bus_skipped_sets_total", "SET_VOLTAGE commands not sent, the level being already applied" );
+      metrics::counter& resyncs = get_counter( "gridfan_bus_resyncs_total", "Line resynchronizations after a failed command" );
+      metrics::counter& init_retries = get_counter( "gridfan_bus_init_retries_total", "Pings retried while initializing the hub" );
+    }
+  }
+
+  // bus transactions, by command, and their failures
+  static void account( uint8_t cmd, controller::result_t result, const std::chrono::microseconds& elapsed )
+  {
+    switch( cmd )
+    {
+      case PING:        stats::pings.inc(); break;
+      case SET_VOLTAGE: stats::sets.inc(); stats::set_latency.observe( elapsed ); break;
+      default:          stats::gets.inc(); stats::get_latency.observe( elapsed ); break;
+    }
+
+    switch( result )
+    {
+      case controller::result_t::timeout:      stats::timeouts.inc(); break;
+      case controller::result_t::invalid_data: stats::invalid.inc(); break;
+      case controller::result_t::io_error:     stats::io.inc(); break;
+      default: break;
+    }
+  }
+
+  static void account_skipped_set()
+  {
+    stats::skipped.inc();
+  }
+
+  // Writes "request" once the bus has been idle for "gap" and reads until
+  // "rx" frames the "answer_size" bytes of its reply, skipping whatever
+  // does not look like one. Running out of time after skipping some bytes
+  // is reported as a bad frame rather than as a timeout.
+  // On timeouts and bad frames the gap is widened for the next commands.
+
+  static controller::result_t exchange(
+      serial::file& file,
+      decoder& rx,
+      std::chrono::microseconds& gap,
+      const uint8_t* request,
+      size_t request_size,
+      uint8_t* answer,
+      size_t answer_size,
+      const std::chrono::milliseconds& timeout )
+  {
+    using result_t = controller::result_t;
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsed = [start]() {
+      return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start );
+    };
+
+    {
+      // the fan index follows the command byte, a ping has none
+      GRID_TRACE_START( paced, pace_return );
+      GRID_TRACE( pace_entry, request_size > 1 ? request[1] : 0, request[0], 0 );
+      std::this_thread::sleep_until( file.get_last_access() + gap );
+      GRID_TRACE( pace_return, request_size > 1 ? request[1] : 0, request[0], GRID_TRACE_ELAPSED( paced ) );
+    }
+
+    // whatever is still buffered belongs to no command
+    const uint8_t* header;
+    const auto header_size = reply_header( request[0], header );
+    rx.expect( header, header_size, answer_size );
+    const auto skipped = rx.discarded();
+
+    if( not file.write( request, request_size ) )
+    {
+      account( request[0], result_t::io_error, elapsed() );
+      return result_t::io_error;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::min<std::chrono::milliseconds>( timeout, 1h );
+    auto result = result_t::ok;
+
+    while( not rx.next( answer ) )
+    {
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>( deadline - std::chrono::steady_clock::now() );
+      auto* at = rx.space();
+      const auto r = ( left > 0ms ) ? file.read( at, rx.room(), left ) : serial::read_result::failure( serial::read_result::timeout );
+
+      if( not r )
+      {
+        result = ( serial::read_result::timeout == r.status ) ? result_t::timeout : result_t::io_error;
+        break;
+      }
+
+      rx.commit( r.amount );
+    }
+
+    if( result_t::timeout == result and rx.discarded() != skipped )
+      result = result_t::invalid_data;
+    else if( result_t::ok == result )
+      result = validate( request[0], answer );
+
+    back_off( result, gap );
+    account( request[0], result, elapsed() );
+    return result;
+  }
+
+  static inline controller::result_t exchange( serial::file& file, decoder& rx, std::chrono::microseconds& gap, frame& f, const std::chrono::milliseconds& timeout )
+  {
+    return exchange( file, rx, gap, f.request, f.request_size, f.answer, f.answer_size, timeout );
+  }
+
+  static inline int decode( const uint8_t* answer )
+  {
+    return uint16_t( ( uint16_t( answer[3] ) << 8 ) | uint16_t( answer[4] ) );
+  }
+
+  // discards whatever is still pending on the line
+  static void drain( serial::file& file, decoder& rx )
+  {
+    rx.expect( nullptr, 0, 0 );
+    uint8_t junk[16];
+    while( file.read( junk, sizeof(junk), 100ms ) )
+      ;
+  }
+
+  // the gap paced before "cmd"
+  static std::chrono::microseconds& gap_for( timings& t, uint8_t cmd )
+  {
+    switch( cmd )
+    {
+      case PING:        return t.ping;
+      case SET_VOLTAGE: return t.set;
+    }
+    return t.get;
+  }
+
+  // retries granted to a command before its failure is reported
+  static constexpr size_t retry_budget = 2;
+
+  // Brings the line back in step: the input is flushed and the hub must
+  // answer a ping; a late reply landing on the first ping gets drained.
+  static bool resync( serial::file& file, decoder& rx, pacer& pacing )
+  {
+    stats::resyncs.inc();
+
+    file.flush();
+
+    for( int i = 0; i < 2; ++i )
+    {
+      uint8_t answer;
+
+      if( controller::result_t::ok == exchange( file, rx, pacing.current.ping, &PING, 1, &answer, 1, 100ms ) )
+        return true;
+
+      drain( file, rx );
+    }
+
+    return false;
+  }
+
+  // Runs "f" within the retry budget: after a timeout or a bad frame the
+  // line is resynchronized and the command sent again (noise around a
+  // reply is already skipped by the decoder). I/O errors, a hub not
+  // answering the ping and failures surviving the whole budget are
+  // reported, these are the ones worth a re-init.
+  static controller::result_t transact( serial::file& file, decoder& rx, pacer& pacing, frame& f, const std::chrono::milliseconds& timeout )
+  {
+    using result_t = controller::result_t;
+
+    auto& gap = gap_for( pacing.current, f.request[0] );
+    auto result = exchange( file, rx, gap, f, timeout );
+    pacing.note( result );
+
+    for( size_t budget = retry_budget; ; --budget )
+    {
+      if( ( result_t::timeout != result and result_t::invalid_data != result ) or 0 == budget )
+        return result;
+
+      if( not resync( file, rx, pacing ) )
+        return result;
+
+      result = exchange( file, rx, gap, f, timeout );
+      pacing.note( result );
+    }
+  }
+
+  constexpr std::chrono::microseconds timings::max;
+
+  void timings::back_off( std::chrono::microseconds& gap )
+  {
+    gap = std::min<std::chrono::microseconds>( max, std::max( gap * 2, gap + 1ms ) );
+  }
+
+  void timings::relax( std::chrono::microseconds& gap, const std::chrono::microseconds& floor )
+  {
+    if( gap <= floor + 1ms )
+      gap = std::min( gap, floor );
+    else
+      gap = floor + ( gap - floor ) / 2;
+  }
+
+  constexpr size_t pacer::recovery;
+
+  void pacer::reset( const timings& t )
+  {
+    current = learned = t;
+    clean = 0;
+  }
+
+  void pacer::note( result_t result )
+  {
+    switch( result )
+    {
+      case result_t::ok:
+        if( ++clean < recovery )
+          return;
+        timings::relax( current.ping, learned.ping );
+        timings::relax( current.get, learned.get );
+        timings::relax( current.set, learned.set );
+        clean = 0;
+        break;
+      case result_t::timeout:
+      case result_t::invalid_data:
+        clean = 0;
+        break;
+      default:
+        break;
+    }
+  }
+
+  bool timings::load( const std::string& filename )
+  {
+    std::ifstream in( filename );
+    timings tmp = *this;
+    std::string name;
+    long long us;
+    size_t count = 0;
+
+    while( in >> name >> us )
+    {
+      if( us < 0 or std::chrono::microseconds( us ) > max )
+        return false;
+
+      if( "ping" == name ) tmp.ping = std::chrono::microseconds( us );
+      else if( "get" == name ) tmp.get = std::chrono::microseconds( us );
+      else if( "set" == name ) tmp.set = std::chrono::microseconds( us );
+      else return false;
+
+      ++count;
+    }
+
+    if( not in.eof() or 0 == count )
+      return false;
+
+    *this = tmp;
+    return true;
+  }
+
+  bool timings::save( const std::string& filename ) const
+  {
+    std::ofstream out( filename, std::ios::trunc );
+    out << "ping " << ping.count() << "\n"
+        << "get " << get.count() << "\n"
+        << "set " << set.count() << "\n";
+    return bool( out.flush() );
+  }
 
   controller::controller(std::nothrow_t, const std::string& filename) noexcept(false)
     : file( filename.c_str(), serial::configuration::make8N1( 4800 ) )
+    , present( 0 )
   {
     if( not file )
     {
@@ -36,7 +421,62 @@ namespace grid {
     file.set_timeout(5s);
 
     for( size_t i = 0; i < fans.size(); ++i )
-      fans[ i ] = fan( file, i + 1 );
+      fans[ i ].index = i + 1;
+
+    present = fans.size();
+
+    bind();
+  }
+
+  controller::controller( controller&& o )
+    : fans( std::move( o.fans ) )
+    , file( std::move( o.file ) )
+    , pacing( o.pacing )
+    , rx( o.rx )
+    , present( o.present )
+  {
+    // its commands now sit on this engine but still refer to "o"
+    o.abandon();
+    bind();
+  }
+
+  controller& controller::operator = ( controller&& o )
+  {
+    if( this != &o )
+    {
+      abandon();
+      o.abandon();
+      fans = std::move( o.fans );
+      file = std::move( o.file );
+      pacing = o.pacing;
+      rx = o.rx;
+      present = o.present;
+      bind();
+    }
+    return *this;
+  }
+
+  // the fans refer to the file and to the timings, these must be re-bound
+  // every time the controller is moved around
+  void controller::bind()
+  {
+    for( auto& f : fans )
+    {
+      f.file = file ? &file : nullptr;
+      f.pacing = file ? &pacing : nullptr;
+      f.rx = file ? &rx : nullptr;
+    }
+  }
+
+  // moves the channels in "populated" (bit N = fan N) to the front, by id
+  void controller::arrange( uint32_t populated )
+  {
+    const auto empty = [populated]( const fan& f ) { return 0 == ( populated & ( 1u << f.id() ) ); };
+
+    std::sort( fans.begin(), fans.end(), [&empty]( const fan& a, const fan& b ) {
+      return std::make_pair( empty( a ), a.id() ) < std::make_pair( empty( b ), b.id() );
+    } );
+    present = size_t( std::find_if( fans.begin(), fans.end(), empty ) - fans.begin() );
   }
 
   controller::controller( const std::string& filename ) noexcept(false)
@@ -53,12 +493,12 @@ namespace grid {
 
 	size_t controller::size() const
 	{
-		return fans.size();
+		return present;
 	}
 
 	bool controller::empty() const
 	{
-		return fans.empty();
+		return 0 == present;
 	}
 
 	controller::iterator controller::begin()
@@ -68,7 +508,7 @@ namespace grid {
 
 	controller::iterator controller::end()
 	{
-		return fans.end();
+		return fans.begin() + present;
 	}
 
 	controller::const_iterator controller::begin() const
@@ -78,7 +518,7 @@ namespace grid {
 
 	controller::const_iterator controller::end() const
 	{
-		return fans.end();
+		return fans.begin() + present;
 	}
 
 	fan& controller::operator [] ( size_t index )
@@ -91,20 +531,374 @@ namespace grid {
 		return fans[ index ];
 	}
 
+	controller::iterator controller::find( size_t id )
+	{
+    return std::find_if( begin(), end(), [id]( const fan& f ){ return f.id() == id; } );
+	}
+
+	controller::const_iterator controller::find( size_t id ) const
+	{
+    return std::find_if( begin(), end(), [id]( const fan& f ){ return f.id() == id; } );
+	}
+
+  static uint8_t command_byte( const controller::command& cmd )
+  {
+    switch( cmd.type )
+    {
+      case controller::command::type_t::set_percent:
+      case controller::command::type_t::force_percent: return SET_VOLTAGE;
+      case controller::command::type_t::get_speed:    return GET_RPM;
+      case controller::command::type_t::get_unknown1: return GET_UNKN1;
+      case controller::command::type_t::get_unknown2: return GET_UNKN2;
+    }
+    return PING;
+  }
+
+  static bool valid( const controller& c, const controller::command& cmd )
+  {
+    return c.end() != c.find( cmd.id )
+       and ( not cmd.sets() or ( cmd.value >= 0 and cmd.value <= 100 ) );
+  }
+
+  std::vector<controller::reply> controller::execute( const std::vector<command>& commands, const std::chrono::milliseconds& timeout )
+  {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<reply> replies;
+    replies.reserve( commands.size() );
+
+    for( const auto& cmd : commands )
+    {
+      const auto start = clock::now();
+      reply rep = { result_t::ok, 0, {} };
+
+      if( not valid( *this, cmd ) )
+      {
+        rep.result = result_t::invalid_argument;
+        replies.push_back( rep );
+        continue;
+      }
+
+      auto& target = *find( cmd.id );
+      auto f = encode( command_byte( cmd ), uint8_t( cmd.id ), percent_to_raw( cmd.value ) );
+      if( command::type_t::set_percent == cmd.type and f.request[5] == target.applied )
+      {
+        account_skipped_set();
+        replies.push_back( rep );
+        continue;
+      }
+
+      if( cmd.sets() )
+        target.applied = fan::unknown;
+
+      rep.result = transact( file, rx, pacing, f, timeout );
+
+      if( result_t::ok == rep.result and cmd.sets() )
+        target.applied = f.request[5];
+
+      if( result_t::ok == rep.result and 5 == f.answer_size )
+        rep.value = decode( f.answer );
+
+      rep.elapsed = std::chrono::duration_cast<std::chrono::microseconds>( clock::now() - start );
+      replies.push_back( rep );
+    }
+
+    return replies;
+  }
+
+  // The counterpart of transact() driven by engine completions: the reply
+  // is framed by the controller decoder, reading again until it shows up or
+  // the time is over, and a timeout or a bad frame is followed by the same
+  // flush, ping (drain) and retry before the result is handed over.
+  // Only the transaction at the front of the backlog talks to the engine,
+  // so that its follow-up reads and pings are not overtaken by other commands.
+  class controller::transaction : public std::enable_shared_from_this<controller::transaction>
+  {
+  public:
+
+    typedef std::function<void( result_t, const frame& )> finish_t;
+
+    transaction( controller& c, const frame& fr, const std::chrono::milliseconds& to, finish_t fin )
+      : owner( c )
+      , io( *c.file.get_engine() )
+      , f( fr )
+      , timeout( to )
+      , finished( std::move( fin ) )
+    {}
+
+    void start()
+    {
+      budget = retry_budget;
+      send();
+    }
+
+    /**
+     * @brief detaches the transaction from its controller: the engine
+     * completions still to come are ignored and "done" is never invoked
+     */
+    void abandon()
+    {
+      abandoned = true;
+
+      // these refer to the transaction itself
+      step.then = nullptr;
+      finished = nullptr;
+    }
+
+  private:
+
+    typedef std::function<void( result_t )> then_t;
+
+    // the command itself
+    void send()
+    {
+      auto self = shared_from_this();
+      exchange( f.request, f.request_size, f.answer, f.answer_size, gap_for( owner.pacing.current, f.request[0] ), timeout, [self]( result_t r ) {
+        self->owner.pacing.note( r );
+        self->sent( r );
+      } );
+    }
+
+    void sent( result_t r )
+    {
+      result = r;
+
+      if( ( result_t::timeout != r and result_t::invalid_data != r ) or 0 == budget )
+        return finish();
+
+      --budget;
+      stats::resyncs.inc();
+      io.flush();
+      pings = 0;
+      ping();
+    }
+
+    void ping()
+    {
+      auto self = shared_from_this();
+      exchange( &PING, 1, &pong, 1, owner.pacing.current.ping, 100ms, [self]( result_t r ) {
+        if( result_t::ok == r )
+          self->send();
+        else
+          self->drain();
+      } );
+    }
+
+    // discards whatever is still pending on the line, then pings again or gives up
+    void drain()
+    {
+      auto self = shared_from_this();
+      owner.rx.expect( nullptr, 0, 0 );
+
+      serial::engine::request r;
+      r.rx = junk;
+      r.rx_size = sizeof(junk);
+      r.rx_all = false;
+      r.timeout = 100ms;
+      r.done = [self]( const serial::engine::completion& c ) {
+        if( self->abandoned )
+          return;
+        if( serial::engine::status::ok == c.status )
+          self->drain();
+        else if( ++self->pings < 2 )
+          self->ping();
+        else
+          self->finish();
+      };
+
+      io.submit( std::move( r ) );
+    }
+
+    void finish()
+    {
+      auto self = shared_from_this();
+      auto done = std::move( finished );
+
+      done( result, f );
+
+      // "done" might have closed the controller
+      if( abandoned )
+        return;
+
+      auto& backlog = owner.backlog;
+      backlog.pop_front();
+      if( not backlog.empty() )
+        backlog.front()->start();
+    }
+
+    // the asynchronous exchange(): writes "request" once the bus has been
+    // idle for "gap" and collects the "answer_size" bytes of its reply
+    void exchange( const uint8_t* request, size_t request_size, uint8_t* answer, size_t answer_size, std::chrono::microseconds& gap, const std::chrono::milliseconds& to, then_t then )
+    {
+      const uint8_t* header;
+      const auto header_size = reply_header( request[0], header );
+
+      owner.rx.expect( header, header_size, answer_size );
+      step = { request[0], answer, &gap, std::min<std::chrono::milliseconds>( to, 1h ), std::chrono::steady_clock::now(), {}, owner.rx.discarded(), std::move( then ) };
+
+      serial::engine::request r;
+      r.tx = request;
+      r.tx_size = request_size;
+      r.gap = gap;
+      r.timeout = to;
+      read( std::move( r ) );
+    }
+
+    void read( serial::engine::request r )
+    {
+      auto self = shared_from_this();
+      r.rx = owner.rx.space();
+      r.rx_size = owner.rx.room();
+      r.rx_all = false;
+      r.done = [self]( const serial::engine::completion& c ) { self->received( c ); };
+      io.submit( std::move( r ) );
+    }
+
+    void received( const serial::engine::completion& c )
+    {
+      if( abandoned )
+        return;
+
+      using clock = std::chrono::steady_clock;
+
+      auto& rx = owner.rx;
+      const auto skipped = [&]() { return rx.discarded() != step.skipped; };
+
+      switch( c.status )
+      {
+        case serial::engine::status::ok:
+          rx.commit( c.amount );
+
+          if( rx.next( step.answer ) )
+            return done( validate( step.cmd, step.answer ) );
+
+          // the timeout runs from the write, as on the blocking calls
+          if( clock::time_point() == step.deadline )
+            step.deadline = io.get_last_write() + step.timeout;
+
+          if( step.deadline > clock::now() )
+          {
+            serial::engine::request r;
+            r.timeout = std::chrono::duration_cast<std::chrono::milliseconds>( step.deadline - clock::now() ) + 1ms;
+            return read( std::move( r ) );
+          }
+
+          return done( skipped() ? result_t::invalid_data : result_t::timeout );
+        case serial::engine::status::timeout:
+          return done( skipped() ? result_t::invalid_data : result_t::timeout );
+        default:
+          return done( result_t::io_error );
+      }
+    }
+
+    void done( result_t r )
+    {
+      back_off( r, *step.gap );
+      account( step.cmd, r, std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - step.start ) );
+
+      auto then = std::move( step.then );
+      then( r );
+    }
+
+    // the exchange in progress
+    struct
+    {
+      uint8_t cmd;
+      uint8_t* answer;
+      std::chrono::microseconds* gap;
+      std::chrono::milliseconds timeout;
+      std::chrono::steady_clock::time_point start;
+      std::chrono::steady_clock::time_point deadline;
+      uint64_t skipped;
+      then_t then;
+    } step;
+
+    controller& owner;
+    serial::engine& io;
+    frame f;
+    const std::chrono::milliseconds timeout;
+    finish_t finished;
+    result_t result = result_t::ok;
+    size_t budget = 0;
+    size_t pings = 0;
+    bool abandoned = false;
+    uint8_t pong = 0;
+    uint8_t junk[16];
+  };
+
+  void controller::submit( const command& cmd, completion_t done, const std::chrono::milliseconds& timeout )
+  {
+    const auto start = std::chrono::steady_clock::now();
+    auto* io = file.get_engine();
+
+    if( not io or not valid( *this, cmd ) )
+    {
+      done( { io ? result_t::invalid_argument : result_t::io_error, 0, {} } );
+      return;
+    }
+
+    auto* target = &*find( cmd.id );
+    const auto sets = cmd.sets();
+    const auto f = encode( command_byte( cmd ), uint8_t( cmd.id ), percent_to_raw( cmd.value ) );
+
+    if( command::type_t::set_percent == cmd.type and f.request[5] == target->applied )
+    {
+      account_skipped_set();
+      done( { result_t::ok, 0, {} } );
+      return;
+    }
+
+    if( sets )
+      target->applied = fan::unknown;
+
+    const auto finish = [target, sets, start, done]( result_t result, const frame& f ) {
+
+      reply rep = { result, 0, {} };
+
+      if( result_t::ok == result and sets )
+        target->applied = f.request[5];
+
+      if( result_t::ok == result and 5 == f.answer_size )
+        rep.value = decode( f.answer );
+
+      rep.elapsed = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start );
+      done( rep );
+    };
+
+    backlog.push_back( std::make_shared<transaction>( *this, f, timeout, finish ) );
+
+    if( 1 == backlog.size() )
+      backlog.front()->start();
+  }
+
+  serial::engine* controller::get_engine()
+  {
+    return file.get_engine();
+  }
+
   controller::result_t controller::init( const std::chrono::milliseconds& timeout )
 	{
     using clock = std::chrono::steady_clock;
 
     const auto end = clock::now() + timeout;
     const auto step = 200ms;
+    GRID_TRACE_START( started, init_retry );
+    GRID_TRACE_ONLY( unsigned attempt = 0; )
 
     while( true )
     {
-      const auto x = file.write( PING ).read<uint8_t>( 100ms );
+      // a missed ping must lead to another attempt rather than to an exception
+      uint8_t answer;
+      std::chrono::microseconds gap = 0ms;
 
-      if( PING_OK == x )
+      if( result_t::ok == exchange( file, rx, gap, &PING, 1, &answer, 1, 100ms ) )
         return result_t::ok;
 
+      stats::init_retries.inc();
+      GRID_TRACE_ONLY( ++attempt; )
+      GRID_TRACE( init_retry, attempt, PING, GRID_TRACE_ELAPSED( started ) );
+      drain( file, rx );
+
       const auto now = clock::now();
 
       if( now > end )
@@ -118,19 +912,201 @@ namespace grid {
 
   controller::result_t controller::ping( const std::chrono::milliseconds& timeout )
 	{
-    std::this_thread::sleep_until(file.get_last_access() + delay_between_access);
-    const auto x = file.write( PING ).read<uint8_t>( timeout );
-    return ( PING_OK != x ) ? result_t::ok : result_t::invalid_data;
+    uint8_t answer;
+    return exchange( file, rx, pacing.current.ping, &PING, 1, &answer, 1, timeout );
 	}
 
+  const timings& controller::calibrate( int percent, size_t rounds )
+  {
+    // candidate gaps, from the safest one down
+    static const std::chrono::microseconds candidates[] = {
+      50ms, 40ms, 30ms, 20ms, 15ms, 10ms, 7ms, 5ms, 3ms, 2ms, 1ms, 0ms
+    };
+
+    const uint8_t raw = percent_to_raw( std::max( 0, std::min( 100, percent ) ) );
+
+    const auto probe = [&]( std::chrono::microseconds& learned, uint8_t cmd ) {
+
+      for( const auto& candidate : candidates )
+      {
+        for( size_t i = 0; i < rounds; ++i )
+        {
+          const uint8_t id = uint8_t( 1 + i % fans.size() );
+          auto f = encode( cmd, id, raw );
+          auto gap = candidate;
+
+          if( result_t::ok != exchange( file, rx, gap, f, 100ms ) )
+          {
+            // the previous candidate was the last reliable one, keep a small margin
+            drain( file, rx );
+            learned = std::min<std::chrono::microseconds>( timings::max, learned + learned / 2 + 1ms );
+            return;
+          }
+        }
+
+        learned = candidate;
+      }
+    };
+
+    timings learned;
+
+    probe( learned.ping, PING );
+    probe( learned.get, GET_RPM );
+    probe( learned.set, SET_VOLTAGE );
+
+    // the SET_VOLTAGE probe changed the levels of every channel behind their back
+    for( auto& f : fans )
+      f.invalidate();
+
+    pacing.reset( learned );
+    return pacing.learned;
+  }
+
+  const timings& controller::get_timings() const
+  {
+    return pacing.learned;
+  }
+
+  void controller::set_timings( const timings& t )
+  {
+    pacing.reset( t );
+  }
+
+  size_t controller::detect( const std::chrono::milliseconds& spinup )
+  {
+    if( not file )
+      return 0;
+
+    // every channel is probed, not only the ones found so far
+    present = fans.size();
+
+    std::vector<command> reads, spins;
+    uint32_t populated = 0;
+
+    for( const auto& f : fans )
+      reads.push_back( command::getSpeed( f.id() ) );
+
+    auto replies = execute( reads );
+
+    for( size_t i = 0; i < reads.size(); ++i )
+    {
+      if( result_t::ok != replies[ i ].result or replies[ i ].value > 0 )
+        populated |= 1u << reads[ i ].id;
+      else
+        spins.push_back( command::forcePercent( reads[ i ].id, 100 ) );
+    }
+
+    if( not spins.empty() )
+    {
+      // a fan might just be standing still at a low voltage
+      execute( spins );
+      std::this_thread::sleep_for( spinup );
+
+      reads.clear();
+      for( const auto& cmd : spins )
+        reads.push_back( command::getSpeed( cmd.id ) );
+
+      replies = execute( reads );
+
+      for( size_t i = 0; i < reads.size(); ++i )
+        if( result_t::ok != replies[ i ].result or replies[ i ].value > 0 )
+          populated |= 1u << reads[ i ].id;
+    }
+
+    arrange( populated );
+    return present;
+  }
+
+  size_t controller::reprobe()
+  {
+    uint32_t populated = 0;
+    std::vector<command> reads;
+
+    for( const auto& f : *this )
+      populated |= 1u << f.id();
+
+    for( auto it = end(); it != fans.end(); ++it )
+      reads.push_back( command::getSpeed( it->id() ) );
+
+    if( reads.empty() )
+      return 0;
+
+    const auto before = present;
+    present = fans.size();
+
+    const auto replies = execute( reads );
+
+    for( size_t i = 0; i < reads.size(); ++i )
+      if( result_t::ok == replies[ i ].result and replies[ i ].value > 0 )
+        populated |= 1u << reads[ i ].id;
+
+    arrange( populated );
+    return present - before;
+  }
+
+  void controller::assume( uint32_t populated )
+  {
+    arrange( populated );
+  }
+
+  controller::~controller()
+  {
+    // before the file goes, closing it completes whatever is queued on the engine
+    abandon();
+  }
+
+  void controller::close()
+  {
+    abandon();
+    file.close();
+  }
+
+  // drops the asynchronous commands not completed yet, without their
+  // completions: these would run from within the destructor or close()
+  void controller::abandon()
+  {
+    for( auto& t : backlog )
+      t->abandon();
+
+    backlog.clear();
+  }
+
+  std::vector<std::string> controller::discover( const std::string& directory )
+  {
+    std::vector<std::string> found;
+    DIR* dir = opendir( directory.c_str() );
+
+    if( nullptr == dir )
+      return found;
+
+    while( const auto* entry = readdir( dir ) )
+    {
+      std::string name = entry->d_name;
+      std::transform( name.begin(), name.end(), name.begin(), []( unsigned char c ) { return char( std::tolower( c ) ); } );
+
+      if( std::string::npos != name.find( "nzxt" ) or std::string::npos != name.find( "grid" ) )
+        found.push_back( directory + "/" + entry->d_name );
+    }
+
+    closedir( dir );
+    std::sort( found.begin(), found.end() );
+    return found;
+  }
+
 	fan::fan()
 		: file( nullptr )
+    , pacing( nullptr )
+    , rx( nullptr )
     , index( 0 )
+    , applied( unknown )
 	{}
 
-	fan::fan(serial::file &f, size_t i )
+	fan::fan(serial::file &f, pacer& p, decoder& d, size_t i )
 		: file( &f )
+    , pacing( &p )
+    , rx( &d )
 		, index( i )
+    , applied( unknown )
 	{}
 
   fan::fan( fan&& o )
@@ -145,6 +1121,9 @@ namespace grid {
     {
       index = o.index;
       file = o.file;
+      pacing = o.pacing;
+      rx = o.rx;
+      applied = o.applied;
     }
     return *this;
   }
@@ -159,46 +1138,53 @@ namespace grid {
 		return index;
 	}
 
-  int fan::get( uint8_t v, const std::chrono::milliseconds& timeout ) const noexcept(false)
+  // the message the throwing calls report "result" with
+  static std::runtime_error failure( result_t result )
   {
-    const uint8_t command[] = { v, uint8_t(index) };
-    uint8_t answer[5];
-
-    std::this_thread::sleep_until(file->get_last_access() + delay_between_access);
-    if( not file->write( command, sizeof(command) ) )
-      throw std::runtime_error( strerror( errno ) );
-
-    std::this_thread::sleep_until(file->get_last_access() + delay_between_access);
-    if( not file->read( answer, sizeof(answer), timeout ) )
-      throw std::runtime_error( strerror( errno ) );
-
-    // The reply should be something like "C0 00 00 02 76".
-    //   "C0 00 00" is always the same and the last two bytes are the fan speed RPM in hex.
-
-    if( answer[0] != 0xc0
-    or  answer[1] != 0x00
-    or  answer[2] != 0x00
-    )
+    switch( result )
     {
-      throw std::runtime_error("unexpected data");
+      case result_t::invalid_data:
+        return std::runtime_error("unexpected data");
+      case result_t::timeout:
+        return std::runtime_error( strerror( errno ) );
+      default:
+        return std::runtime_error("I/O error");
     }
+  }
 
-    return uint16_t( ( uint16_t( answer[3] ) << 8 ) | uint16_t( answer[4] ) );
+  outcome<int> fan::get( uint8_t v, const std::chrono::milliseconds& timeout ) const noexcept
+  {
+    if( nullptr == file )
+      return { result_t::io_error, 0 };
+
+    auto f = encode( v, uint8_t(index) );
+    const auto result = transact( *file, *rx, *pacing, f, timeout );
+
+    return { result, result_t::ok == result ? decode( f.answer ) : 0 };
   }
 
   int fan::getSpeed( const std::chrono::milliseconds& timeout ) const noexcept(false)
 	{
-    return get(GET_RPM, timeout);
+    const auto r = get(GET_RPM, timeout);
+    if( not r )
+      throw failure( r.result );
+    return r.value;
 	}
 
   int fan::getUnknown1( const std::chrono::milliseconds& timeout ) const noexcept(false)
   {
-    return get(GET_UNKN1, timeout);
+    const auto r = get(GET_UNKN1, timeout);
+    if( not r )
+      throw failure( r.result );
+    return r.value;
   }
 
   int fan::getUnknown2( const std::chrono::milliseconds& timeout ) const noexcept(false)
   {
-    return get(GET_UNKN2, timeout);
+    const auto r = get(GET_UNKN2, timeout);
+    if( not r )
+      throw failure( r.result );
+    return r.value;
   }
 
   void fan::setPercent( int pr )
@@ -206,28 +1192,94 @@ namespace grid {
     if( pr < 0 or pr > 100 )
       throw std::runtime_error("invalid percent value: " + std::to_string(pr));
 
-    uint8_t raw = uint8_t( 4 + std::min( 8, ( pr - 20 ) * 8 / 75 ) );
+    const auto result = set( pr, false );
+    if( result_t::ok != result )
+      throw failure( result );
+	}
 
-    // la velocita' va da 0 a 12
-    // non puo' essere maggiore di 0 e minore di 4
-    // quindi se == 1 lo trasformo in zero
-    // se 2 o 3 lo trasformo in 4
+  void fan::forcePercent( int pr )
+	{
+    if( pr < 0 or pr > 100 )
+      throw std::runtime_error("invalid percent value: " + std::to_string(pr));
 
-    if( raw < 4 ) raw = 4;
-    if( raw < 2 ) raw = 0;
+    const auto result = set( pr, true );
+    if( result_t::ok != result )
+      throw failure( result );
+	}
+
+  outcome<int> fan::tryGetSpeed( const std::chrono::milliseconds& timeout ) const noexcept
+  {
+    return get(GET_RPM, timeout);
+  }
+
+  outcome<int> fan::tryGetUnknown1( const std::chrono::milliseconds& timeout ) const noexcept
+  {
+    return get(GET_UNKN1, timeout);
+  }
+
+  outcome<int> fan::tryGetUnknown2( const std::chrono::milliseconds& timeout ) const noexcept
+  {
+    return get(GET_UNKN2, timeout);
+  }
+
+  result_t fan::trySetPercent( int pr ) noexcept
+  {
+    return set( pr, false );
+  }
+
+  result_t fan::tryForcePercent( int pr ) noexcept
+  {
+    return set( pr, true );
+  }
+
+  void fan::invalidate()
+  {
+    applied = unknown;
+  }
+
+  uint8_t fan::raw( int percent )
+  {
+    return percent_to_raw( std::max( 0, std::min( 100, percent ) ) );
+  }
 
-		const uint8_t command[7] = {
-      SET_VOLTAGE, uint8_t(index), 0xc0 , 0, 0, raw, 0
-		};
+  result_t fan::set( int pr, bool force ) noexcept
+	{
+    if( pr < 0 or pr > 100 )
+      return result_t::invalid_argument;
+
+    if( nullptr == file )
+      return result_t::io_error;
+
+    const auto raw = percent_to_raw( pr );
+
+    if( raw == applied and not force )
+    {
+      account_skipped_set();
+      return result_t::ok;
+    }
 
-    std::this_thread::sleep_until(file->get_last_access() + delay_between_access);
-    if( not file->write( command ) )
-      throw std::runtime_error("I/O error");
+    // whatever happens from now on the hub state is not known anymore
+    applied = unknown;
 
-    std::this_thread::sleep_until(file->get_last_access() + delay_between_access);
-    const auto result = file->read<uint8_t>();
+    auto f = encode( SET_VOLTAGE, uint8_t(index), raw );
+    const auto result = transact( *file, *rx, *pacing, f, file->get_timeout() );
 
-    if( result != 0x01 )
-      throw std::runtime_error("invalid data");
+    if( result_t::ok == result )
+      applied = raw;
+
+    return result;
 	}
+
+  const char* to_string( result_t result ) noexcept
+  {
+    switch( result )
+    {
+      case controller::result_t::ok:               return "ok";
+      case controller::result_t::timeout:          return "timeout";
+      case controller::result_t::invalid_data:     return "unexpected data";
+      case controller::result_t::invalid_argument: return "invalid argument";
+      case controller::result_t::io_error:         return "I/O error";
+    }
+    return "unknown error";
+  }
 }
@@ -2,8 +2,11 @@
 #define LIBFANGRID_H
 
 #include "serial.hpp"
+#include "decoder.hpp"
 #include <array>
+#include <deque>
 #include <memory>
+#include <string>
 #include <type_traits>
 #include <vector>
 #include <functional>
@@ -12,6 +15,82 @@ using namespace std::chrono_literals;
 
 namespace grid
 {
+  /**
+   * @brief how long the bus is left idle before a command is written to it,
+   * one gap per command type.
+   * The defaults are the conservative ones, controller::calibrate() learns
+   * the shortest reliable ones and the gaps grow back on timeouts and bad
+   * frames, see pacer.
+   */
+  struct timings
+  {
+    static constexpr std::chrono::microseconds max = 50ms;
+
+    std::chrono::microseconds ping = max;
+    std::chrono::microseconds get = max;
+    std::chrono::microseconds set = max;
+
+    /**
+     * @brief doubles "gap" (at least 1ms more) up to "max"
+     */
+    static void back_off( std::chrono::microseconds& gap );
+
+    /**
+     * @brief halves the distance between "gap" and "floor", the undoing of back_off()
+     */
+    static void relax( std::chrono::microseconds& gap, const std::chrono::microseconds& floor );
+
+    /**
+     * @brief reads/writes the gaps from/to "filename" as "<name> <microseconds>" lines
+     * @return false in case of I/O or format errors
+     */
+    bool load( const std::string& filename );
+    bool save( const std::string& filename ) const;
+  };
+
+  /**
+   * @brief how a bus command went
+   */
+  enum class result_t { ok, timeout, invalid_data, invalid_argument, io_error };
+
+  const char* to_string( result_t result ) noexcept;
+
+  /**
+   * @brief the outcome of a command reading something back, for the
+   * callers that rather not catch exceptions: "value" is only meaningful
+   * when "result" is result_t::ok
+   */
+  template <typename value_t>
+  struct outcome
+  {
+    result_t result;
+    value_t value;
+
+    explicit operator bool () const noexcept { return result_t::ok == result; }
+  };
+
+  /**
+   * @brief the gaps in use on a bus: "current" is widened on timeouts and
+   * bad frames and narrowed back a step toward "learned" (the calibrated or
+   * loaded ones) every "recovery" clean transactions in a row, so that a
+   * noisy spell does not slow the bus down for good.
+   */
+  struct pacer
+  {
+    static constexpr size_t recovery = 32;
+
+    timings current;
+    timings learned;
+    size_t clean = 0; // transactions since the last timeout or bad frame
+
+    void reset( const timings& t );
+
+    /**
+     * @brief accounts for a transaction that ended with "result"
+     */
+    void note( result_t result );
+  };
+
 	class fan
 	{
 	public:
@@ -19,7 +98,7 @@ namespace grid
 		typedef size_t id_t;
 
 		fan();
-    fan( serial::file& f, id_t index );
+    fan( serial::file& f, pacer& p, decoder& d, id_t index );
     fan(fan&& o );
     fan& operator = ( fan&& o );
 		operator bool () const;
@@ -27,14 +106,56 @@ namespace grid
     int getSpeed( const std::chrono::milliseconds &timeout = 500ms ) const noexcept(false);
     int getUnknown1( const std::chrono::milliseconds &timeout = 500ms ) const noexcept(false);
     int getUnknown2( const std::chrono::milliseconds &timeout = 500ms ) const noexcept(false);
+    /**
+     * @brief sets the fan speed, nothing is sent if the hub already
+     * acknowledged the raw level "percent" maps to
+     */
     void setPercent( int );
 
+    /**
+     * @brief sets the fan speed even if it looks already applied,
+     * for resyncing with the hub
+     */
+    void forcePercent( int );
+
+    /**
+     * @brief the non-throwing counterparts of the calls above: the failures
+     * are returned rather than thrown, so that a flaky bus costs no
+     * exception (nor its message) to allocate and unwind. The metrics they
+     * update are registered when the library is loaded.
+     * A fan not bound to a controller reports result_t::io_error, a percent
+     * out of 0-100 result_t::invalid_argument.
+     */
+    outcome<int> tryGetSpeed( const std::chrono::milliseconds &timeout = 500ms ) const noexcept;
+    outcome<int> tryGetUnknown1( const std::chrono::milliseconds &timeout = 500ms ) const noexcept;
+    outcome<int> tryGetUnknown2( const std::chrono::milliseconds &timeout = 500ms ) const noexcept;
+    result_t trySetPercent( int ) noexcept;
+    result_t tryForcePercent( int ) noexcept;
+
+    /**
+     * @brief forgets the level last acknowledged by the hub
+     */
+    void invalidate();
+
+    /**
+     * @brief the raw voltage level (4-12) the hub is set to for "percent"
+     */
+    static uint8_t raw( int percent );
+
 	private:
 
-    int get( uint8_t, const std::chrono::milliseconds &timeout = 500ms ) const noexcept(false);
+    friend class controller;
+
+    static constexpr uint8_t unknown = 0xff;
+
+    outcome<int> get( uint8_t, const std::chrono::milliseconds &timeout ) const noexcept;
+    result_t set( int pr, bool force ) noexcept;
 
     serial::file* file;
+    pacer* pacing;
+    decoder* rx;
 		id_t index;
+    uint8_t applied; // the last raw level acknowledged by the hub
 	};
 
 	class controller
@@ -42,11 +163,41 @@ namespace grid
 	public:
     explicit controller(const std::string& filename = "/dev/GridPlus0" ) noexcept(false);
     explicit controller(std::nothrow_t, const std::string& filename = "/dev/GridPlus0") noexcept(false);
+    controller( controller&& o );
+    controller& operator = ( controller&& o );
+    ~controller();
 
-    enum class result_t { ok, timeout, invalid_data };
+    typedef grid::result_t result_t;
+
+    // a single step of a batch, see execute()
+    struct command
+    {
+      enum class type_t { set_percent, force_percent, get_speed, get_unknown1, get_unknown2 };
+
+      static command setPercent( fan::id_t id, int percent ) { return { type_t::set_percent, id, percent }; }
+      static command forcePercent( fan::id_t id, int percent ) { return { type_t::force_percent, id, percent }; }
+      static command getSpeed( fan::id_t id ) { return { type_t::get_speed, id, 0 }; }
+      static command getUnknown1( fan::id_t id ) { return { type_t::get_unknown1, id, 0 }; }
+      static command getUnknown2( fan::id_t id ) { return { type_t::get_unknown2, id, 0 }; }
+
+      type_t type;
+      fan::id_t id;
+      int value; // the percent for set/force_percent, unused otherwise
+
+      bool sets() const { return type_t::set_percent == type or type_t::force_percent == type; }
+    };
+
+    struct reply
+    {
+      result_t result;
+      int value; // the value read back by the get_* commands
+      std::chrono::microseconds elapsed; // time spent on the bus, pacing included
+    };
 
 		operator bool () const;
 
+    // size(), the iteration and find() only cover the populated channels,
+    // all of them until detect() is called
     typedef std::array<fan,6>::iterator iterator;
     typedef std::array<fan,6>::const_iterator const_iterator;
 
@@ -65,13 +216,102 @@ namespace grid
 		iterator find( size_t id );
 		const_iterator find( size_t id ) const;
 
+    /**
+     * @brief runs "commands" back to back as one paced pipeline, each command
+     * waits only for the bus to settle before being written and its reply is
+     * read as soon as it is available.
+     * A failing command does not abort the batch, a set_percent whose raw
+     * level is already applied is not sent at all (see fan::setPercent()).
+     * @return one reply per command, in the same order
+     */
+    std::vector<reply> execute( const std::vector<command>& commands, const std::chrono::milliseconds& timeout = 500ms );
+
+    typedef std::function<void( const reply& )> completion_t;
+
+    /**
+     * @brief asynchronous counterpart of execute(): queues "cmd" and returns
+     * immediately, "done" is invoked from within serial::engine::process()
+     * once the reply has been collected. The replies are framed and the
+     * failures retried as on the blocking calls, so the commands go to the
+     * engine one at a time.
+     * Several controllers can be driven by one thread polling their engines.
+     * Commands still queued when the controller is closed, moved or
+     * destroyed are dropped, their "done" is not invoked; "done" may close
+     * the controller but not destroy it, the engine is still running it.
+     */
+    void submit( const command& cmd, completion_t done, const std::chrono::milliseconds& timeout = 500ms );
+
+    serial::engine* get_engine();
+
+    /**
+     * @brief measures, for each command type, the shortest gap the device
+     * handles reliably for "rounds" consecutive commands and starts using it.
+     * @param percent: the speed the fans are set to while probing SET_VOLTAGE,
+     * their next setPercent() is always sent
+     * @return the learned timings
+     */
+    const timings& calibrate( int percent = 100, size_t rounds = 10 );
+
+    /**
+     * @brief the learned timings, the ones the gaps in use go back to after a
+     * back-off; setting them resets the gaps in use as well
+     */
+    const timings& get_timings() const;
+    void set_timings( const timings& t );
+
+    /**
+     * @brief finds out which channels have a fan attached: the ones reading
+     * 0 RPM are spun up at full speed and read again after "spinup".
+     * The empty channels are left at full speed, so that a fan connected
+     * later on is spinning by the time reprobe() reads it.
+     * A channel that cannot be read is assumed to be populated.
+     * @return the amount of populated channels
+     */
+    size_t detect( const std::chrono::milliseconds& spinup = 3s );
+
+    /**
+     * @brief reads the speed of the empty channels only, the ones
+     * now spinning are handled from now on
+     * @return the amount of fans found
+     */
+    size_t reprobe();
+
+    /**
+     * @brief takes "populated" (bit N = fan N) as the populated channels
+     * without probing them, eg. the ones found before the hub was reconnected
+     */
+    void assume( uint32_t populated );
+
+    /**
+     * @brief releases the device, the controller is not valid anymore;
+     * the asynchronous commands still queued are dropped
+     */
+    void close();
+
+    /**
+     * @brief the Grid+ hubs found in "directory" (the udev persistent names,
+     * whose name mentions NZXT or Grid), sorted by name; these paths do
+     * not change when the hub is re-enumerated
+     */
+    static std::vector<std::string> discover( const std::string& directory = "/dev/serial/by-id" );
+
 	private:
 
     result_t init(const std::chrono::milliseconds& timeout );
     result_t ping( const std::chrono::milliseconds& timeout );
 
+    class transaction; // an asynchronous command, see submit()
+
+    void bind();
+    void arrange( uint32_t populated );
+    void abandon();
+
     std::array<fan,6> fans;
     serial::file file;
+    pacer pacing;
+    decoder rx; // the replies read back
+    std::deque<std::shared_ptr<transaction>> backlog; // the front one owns the bus
+    size_t present; // the populated channels, at the front of "fans"
 	};
 }
 
@@ -0,0 +1,170 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace grid
+{
+  namespace metrics
+  {
+    constexpr size_t histogram::octaves;
+    constexpr size_t histogram::buckets;
+
+    histogram::histogram() noexcept
+      : total( 0 )
+      , sum_us( 0 )
+    {
+      for( auto& c : counts )
+        c.store( 0, std::memory_order_relaxed );
+    }
+
+    // bucket 2*o covers (2^o, 1.5*2^o], bucket 2*o+1 covers (1.5*2^o, 2^(o+1)]
+    uint64_t histogram::upper( size_t index ) noexcept
+    {
+      const uint64_t base = uint64_t( 1 ) << ( index / 2 );
+      return ( index % 2 ) ? 2 * base : base + base / 2;
+    }
+
+    void histogram::observe( const std::chrono::microseconds& elapsed ) noexcept
+    {
+      const uint64_t us = elapsed.count() > 0 ? uint64_t( elapsed.count() ) : 0;
+      size_t index = 0;
+
+      if( us > 1 )
+      {
+        const size_t o = 63 - __builtin_clzll( us );
+        const uint64_t base = uint64_t( 1 ) << o;
+
+        if( us == base )
+          index = 2 * o - 1;
+        else if( us <= base + base / 2 )
+          index = 2 * o;
+        else
+          index = 2 * o + 1;
+      }
+
+      counts[ std::min( index, buckets ) ].fetch_add( 1, std::memory_order_relaxed );
+      total.fetch_add( 1, std::memory_order_relaxed );
+      sum_us.fetch_add( us, std::memory_order_relaxed );
+    }
+
+    namespace
+    {
+      template <typename metric_t>
+      struct entry
+      {
+        std::string name;
+        std::string help;
+        metric_t metric;
+
+        entry( const std::string& n, const std::string& h ) : name( n ), help( h ) {}
+      };
+
+      // deques never move their elements, the references handed out stay valid
+      struct registry
+      {
+        std::mutex mutex;
+        std::deque<entry<counter>> counters;
+        std::deque<entry<histogram>> histograms;
+      };
+
+      registry& global()
+      {
+        static registry r;
+        return r;
+      }
+
+      template <typename metric_t>
+      metric_t& find( std::deque<entry<metric_t>>& all, const std::string& name, const std::string& help )
+      {
+        for( auto& e : all )
+          if( e.name == name )
+            return e.metric;
+
+        all.emplace_back( name, help );
+        return all.back().metric;
+      }
+
+      std::string family( const std::string& name )
+      {
+        return name.substr( 0, name.find( '{' ) );
+      }
+
+      std::string seconds( uint64_t us )
+      {
+        char text[32];
+        snprintf( text, sizeof(text), "%g", us / 1e6 );
+        return text;
+      }
+    }
+
+    counter& get_counter( const std::string& name, const std::string& help )
+    {
+      auto& r = global();
+      const std::lock_guard<std::mutex> lock( r.mutex );
+      return find( r.counters, name, help );
+    }
+
+    histogram& get_histogram( const std::string& name, const std::string& help )
+    {
+      auto& r = global();
+      const std::lock_guard<std::mutex> lock( r.mutex );
+      return find( r.histograms, name, help );
+    }
+
+    std::string render()
+    {
+      auto& r = global();
+      const std::lock_guard<std::mutex> lock( r.mutex );
+      std::string out;
+      std::string last;
+
+      // the samples of a family must be contiguous
+      std::vector<const entry<counter>*> counters;
+      for( const auto& e : r.counters )
+        counters.push_back( &e );
+
+      std::stable_sort( counters.begin(), counters.end(), []( const entry<counter>* a, const entry<counter>* b ) {
+        return family( a->name ) < family( b->name );
+      } );
+
+      for( const auto* c : counters )
+      {
+        const auto& e = *c;
+        const auto f = family( e.name );
+
+        if( f != last )
+        {
+          out += "# HELP " + f + " " + e.help + "\n# TYPE " + f + " counter\n";
+          last = f;
+        }
+
+        out += e.name + " " + std::to_string( e.metric.value() ) + "\n";
+      }
+
+      for( const auto& e : r.histograms )
+      {
+        const auto& h = e.metric;
+        uint64_t cumulative = 0;
+
+        out += "# HELP " + e.name + " " + e.help + "\n# TYPE " + e.name + " histogram\n";
+
+        for( size_t i = 0; i < histogram::buckets; ++i )
+        {
+          cumulative += h.bucket( i );
+          out += e.name + "_bucket{le=\"" + seconds( histogram::upper( i ) ) + "\"} " + std::to_string( cumulative ) + "\n";
+        }
+
+        cumulative += h.bucket( histogram::buckets );
+        out += e.name + "_bucket{le=\"+Inf\"} " + std::to_string( cumulative ) + "\n";
+        out += e.name + "_sum " + seconds( h.sum() ) + "\n";
+        out += e.name + "_count " + std::to_string( h.count() ) + "\n";
+      }
+
+      return out;
+    }
+  }
+}
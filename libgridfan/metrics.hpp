@@ -0,0 +1,98 @@
+#ifndef LIBGRIDFAN_METRICS_H
+#define LIBGRIDFAN_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace grid
+{
+  /**
+   * @brief process wide instrumentation: counters and latency histograms,
+   * rendered in the Prometheus text exposition format.
+   * Metrics are registered once (the first lookup of a name allocates it)
+   * and then updated with relaxed atomics only, so they can be bumped from
+   * any thread, hot paths included.
+   */
+  namespace metrics
+  {
+    class counter
+    {
+    public:
+      counter() noexcept : count( 0 ) {}
+
+      void inc( uint64_t n = 1 ) noexcept { count.fetch_add( n, std::memory_order_relaxed ); }
+      uint64_t value() const noexcept { return count.load( std::memory_order_relaxed ); }
+
+    private:
+      std::atomic<uint64_t> count;
+    };
+
+    /**
+     * @brief log-linear histogram of durations: every power of two from
+     * 1us to 2^(octaves-1)us is split in two linear halves, so the
+     * relative error stays within 25% across the whole range.
+     */
+    class histogram
+    {
+    public:
+
+      static constexpr size_t octaves = 25; // up to ~33s
+      static constexpr size_t buckets = 2 * octaves;
+
+      histogram() noexcept;
+
+      void observe( const std::chrono::microseconds& elapsed ) noexcept;
+
+      /**
+       * @brief the upper bound of bucket "index", in microseconds
+       */
+      static uint64_t upper( size_t index ) noexcept;
+
+      uint64_t bucket( size_t index ) const noexcept { return counts[ index ].load( std::memory_order_relaxed ); }
+      uint64_t count() const noexcept { return total.load( std::memory_order_relaxed ); }
+      uint64_t sum() const noexcept { return sum_us.load( std::memory_order_relaxed ); }
+
+    private:
+      std::atomic<uint64_t> counts[ buckets + 1 ]; // the last one is +Inf
+      std::atomic<uint64_t> total;
+      std::atomic<uint64_t> sum_us;
+    };
+
+    /**
+     * @brief observes the time elapsed between its construction and its destruction
+     */
+    class timer
+    {
+    public:
+      explicit timer( histogram& h ) noexcept : target( h ), start( std::chrono::steady_clock::now() ) {}
+      ~timer() { target.observe( std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ) ); }
+
+    private:
+      timer( const timer& ) = delete;
+      timer& operator = ( const timer& ) = delete;
+
+      histogram& target;
+      const std::chrono::steady_clock::time_point start;
+    };
+
+    /**
+     * @brief the counter called "name", created on first use; "name" may
+     * carry labels, eg. 'gridfan_bus_errors_total{kind="timeout"}'
+     */
+    counter& get_counter( const std::string& name, const std::string& help );
+
+    /**
+     * @brief the histogram called "name" (no labels), created on first use
+     */
+    histogram& get_histogram( const std::string& name, const std::string& help );
+
+    /**
+     * @brief all the metrics in the Prometheus text format, histograms in seconds
+     */
+    std::string render();
+  }
+}
+
+#endif // LIBGRIDFAN_METRICS_H
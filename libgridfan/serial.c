@@ -4,9 +4,15 @@
 #include <time.h>
 
 #include "serial.h"
+#include "trace.h"
 
 #define READ_TIMEOUT_MS 100 // deve essere >= 100
 
+GRID_TRACE_PROBE( serial_read_entry )
+GRID_TRACE_PROBE( serial_read_return )
+GRID_TRACE_PROBE( serial_write_entry )
+GRID_TRACE_PROBE( serial_write_return )
+
 #ifdef _WIN32
 
 serial_t openSerial( const char* filename, unsigned baudrate )
@@ -223,7 +229,7 @@ void serial_close( serial_t serial )
 	}
 }
 
-size_t serial_read( serial_t serial, void* buffer, size_t* buff_size , uint32_t timeout_ms )
+static size_t read_some( serial_t serial, void* buffer, size_t* buff_size , uint32_t timeout_ms )
 {
   if( ( INVALID_SERIAL == serial ) ||
       ( NULL == buffer ) ||
@@ -270,14 +276,14 @@ size_t serial_read( serial_t serial, void* buffer, size_t* buff_size , uint32_t
           if(EAGAIN == errno)
           {
             const uint32_t ms = (uint32_t)(clock() - now) * 1000 / CLOCKS_PER_SEC;
-            return serial_read( serial, buffer, buff_size, timeout_ms - ms );
+            return read_some( serial, buffer, buff_size, timeout_ms - ms );
           }
           break;
         case 0:
           errno = ETIME;
           break;
         default:
-          return serial_read( serial, buffer, buff_size, NO_TIMEOUT );
+          return read_some( serial, buffer, buff_size, NO_TIMEOUT );
       }
     }
   }
@@ -285,6 +291,17 @@ size_t serial_read( serial_t serial, void* buffer, size_t* buff_size , uint32_t
 	return 0;
 }
 
+size_t serial_read( serial_t serial, void* buffer, size_t* buff_size , uint32_t timeout_ms )
+{
+  GRID_TRACE_START( start, serial_read_return );
+  GRID_TRACE( serial_read_entry, serial, 0, 0 );
+
+  const size_t ok = read_some( serial, buffer, buff_size, timeout_ms );
+
+  GRID_TRACE( serial_read_return, serial, ( ok && *buff_size ) ? *(const uint8_t*)buffer : 0, GRID_TRACE_ELAPSED( start ) );
+  return ok;
+}
+
 size_t serial_write( serial_t serial, const void* buffer, size_t buff_size )
 {
   if( ( INVALID_SERIAL == serial ) ||
@@ -295,6 +312,9 @@ size_t serial_write( serial_t serial, const void* buffer, size_t buff_size )
   }
   else
   {
+    GRID_TRACE_START( start, serial_write_return );
+    GRID_TRACE( serial_write_entry, serial, *(const uint8_t*)buffer, 0 );
+
     ssize_t tot = 0;
 
     while( tot != (ssize_t)buff_size )
@@ -308,10 +328,53 @@ size_t serial_write( serial_t serial, const void* buffer, size_t buff_size )
 
       tot += w;
     }
+
+    GRID_TRACE( serial_write_return, serial, *(const uint8_t*)buffer, GRID_TRACE_ELAPSED( start ) );
   }
   return 1;
 }
 
+size_t serial_write_some( serial_t serial, const void* buffer, size_t* buff_size )
+{
+  if( ( INVALID_SERIAL == serial ) ||
+      ( NULL == buffer ) ||
+      ( NULL == buff_size ) ) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  GRID_TRACE_START( start, serial_write_return );
+  GRID_TRACE( serial_write_entry, serial, *buff_size ? *(const uint8_t*)buffer : 0, 0 );
+
+  const ssize_t w = write( serial, buffer, *buff_size );
+
+  GRID_TRACE( serial_write_return, serial, *buff_size ? *(const uint8_t*)buffer : 0, GRID_TRACE_ELAPSED( start ) );
+
+  if( w < 0 )
+  {
+    if( EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno )
+    {
+      *buff_size = 0;
+      return 1;
+    }
+    return 0;
+  }
+
+  *buff_size = (size_t)w;
+  return 1;
+}
+
+size_t serial_flush( serial_t serial )
+{
+  if( INVALID_SERIAL == serial )
+  {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return 0 == tcflush( serial, TCIFLUSH );
+}
+
 #endif // segue codice multipiattaforma
 
 size_t serial_read_all( serial_t serial, void* buffer, size_t buff_size , uint32_t timeout_ms )
@@ -94,6 +94,23 @@ size_t serial_read_all( serial_t serial, void* buffer, size_t buff_size, uint32_
 */
 size_t serial_write( serial_t serial, const void* buffer, size_t buff_size );
 
+/**
+ * @brief writes up to "buff_size" bytes to "serial" without blocking, reading them
+ * from "buffer" and writing the amount of bytes actually written into "buff_size"
+ * @param serial: the serial handle to write
+ * @param buffer: the buffer containing the data to write
+ * @param buff_size: the maximum amount of bytes to write, will contain the amount of bytes written
+ * @return 1 if succesfull (even if nothing could be written), 0 otherwise
+*/
+size_t serial_write_some( serial_t serial, const void* buffer, size_t* buff_size );
+
+/**
+ * @brief discards the data received on "serial" and not read yet
+ * @param serial: the serial handle to flush
+ * @return 1 if succesfull, 0 otherwise
+*/
+size_t serial_flush( serial_t serial );
+
 /**
  * @brief configures "settings" in the common 8-N-1 mode
  * @param baudrate: the expected baudrate
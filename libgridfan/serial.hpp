@@ -10,8 +10,11 @@
 #include <mutex>
 #include <stdexcept>
 #include <chrono>
+#include <memory>
 
 #include "serial.h"
+#include "engine.hpp"
+#include "metrics.hpp"
 
 using namespace std::chrono_literals;
 
@@ -130,21 +133,49 @@ namespace serial
 		read_result( enum status st, size_t sz ) : status( st ), amount( sz ) {}
 	};
 
-  static constexpr auto infinite = std::chrono::milliseconds::max();
+	/**
+	 * @brief a value read from the line, meaningful when "status" is read_result::ok
+	 */
+	template<typename type_t>
+	struct value_result
+	{
+		enum read_result::status status;
+		type_t value;
+		inline explicit operator bool() const noexcept { return read_result::ok == status; }
+	};
+
+	/**
+	 * @brief the serial line metrics, registered when the library is loaded
+	 * so that the reads and writes never allocate them
+	 */
+	struct line_metrics
+	{
+		grid::metrics::histogram& write_latency;
+		grid::metrics::counter& write_failures;
+		grid::metrics::histogram& read_latency;
+		grid::metrics::counter& read_timeouts;
+		grid::metrics::counter& read_failures;
+	};
+
+	const line_metrics& line_stats() noexcept;
+
   static constexpr auto use_global = std::chrono::milliseconds::min();
 
+	/**
+	 * @brief blocking serial file, a thin wrapper driving its own serial::engine
+	 */
 	class file
 	{
 	public:
 
-    using clock = std::chrono::steady_clock;
+    using clock = engine::clock;
 
 		file() noexcept
-			: handle( INVALID_SERIAL )
+      : timeout(infinite)
 		{}
 
 		file( const char* filename, const configuration& config ) noexcept
-			: handle( serial_open( filename, *config ) )
+      : io( new engine( serial_open( filename, *config ) ) )
       , timeout(infinite)
 		{}
 
@@ -161,12 +192,8 @@ namespace serial
 
       if( this != &other )
       {
-        serial_close( handle );
-        this->handle = other.handle;
-        this->last_read = other.last_read;
-        this->last_write = other.last_write;
+        this->io = std::move( other.io );
         this->timeout = other.timeout;
-        other.handle = INVALID_SERIAL;
       }
 
 			return *this;
@@ -175,29 +202,50 @@ namespace serial
     virtual ~file() noexcept
 		{
       const std::lock_guard<std::mutex> lock( mutex );
-      serial_close( handle );
+      io.reset();
 		}
 
 		explicit operator bool () const noexcept
-		{ return INVALID_SERIAL != handle; }
+		{ return io and bool( *io ); }
 
     void close()
     {
       const std::lock_guard<std::mutex> lock( mutex );
-      serial_close( handle );
-      handle = INVALID_SERIAL;
+      io.reset();
     }
 
+    /**
+     * @brief discards whatever was received and not read yet
+     */
+    bool flush() noexcept
+    {
+      const std::lock_guard<std::mutex> lock( mutex );
+      return io and io->flush();
+    }
+
+    /**
+     * @brief the underlying engine, for asynchronous use.
+     * @note it must not be driven concurrently with the blocking calls
+     */
+    engine* get_engine() noexcept
+    { return io.get(); }
+
 		bool write( const void* data, size_t count ) noexcept
 		{
+      const auto& stats = line_stats();
       const std::lock_guard<std::mutex> lock( mutex );
+      const grid::metrics::timer t( stats.write_latency );
 
-      const auto success = serial_write( handle, data, count );
-      last_write = clock::now();
+      engine::request r;
+      r.tx = data;
+      r.tx_size = count;
 
-      if( success )
+      const auto c = transfer( std::move( r ) );
+
+      if( engine::status::ok == c.status )
         return true;
 
+      stats.write_failures.inc();
       std::cerr << "serial::write error: " << strerror(errno) << std::endl;
       return false;
 		}
@@ -210,45 +258,12 @@ namespace serial
 
     read_result read( void* data, size_t count, const std::chrono::milliseconds& to = use_global ) noexcept
 		{
-      const std::lock_guard<std::mutex> lock( mutex );
-
-			if( timeout < 0s )
-				return read_result::failure( read_result::timeout );
-
-      const auto x = to == use_global ? timeout : to;
-
-      const auto success = serial_read( handle, data, &count, x == infinite ? NO_TIMEOUT : uint32_t( x.count() ) );
-
-      last_read = clock::now();
-
-      if (success)
-        return read_result::success( count );
-
-      if(ETIME == errno)
-        return read_result::failure( read_result::timeout );
-
-      return read_result::failure( read_result::error );
+      return read( data, count, to, false );
 		}
 
     read_result read_all( void* data, size_t count, const std::chrono::milliseconds& to = use_global ) noexcept
 		{
-      const std::lock_guard<std::mutex> lock( mutex );
-
-			if( timeout.count() < 0 )
-				return read_result::failure( read_result::timeout );
-
-      const auto x = to == use_global ? timeout : to;
-
-      const auto success = serial_read_all( handle, data, count, x == infinite ? NO_TIMEOUT : uint32_t( x.count() ) );
-      last_read = clock::now();
-
-      if (success)
-        return read_result::success( count );
-
-      if(ETIME == errno)
-        return read_result::failure( read_result::timeout );
-
-      return read_result::failure( read_result::error );
+      return read( data, count, to, true );
 		}
 
 		template<typename type_t>
@@ -272,10 +287,23 @@ namespace serial
 		typename std::enable_if<std::is_trivially_copyable<type_t>::value, type_t>::type
     inline read( const std::chrono::milliseconds& timeout = use_global ) noexcept(false)
 		{
-			type_t some;
-      if( not read( some, timeout ) )
-        throw std::runtime_error( strerror( errno ) );
-			return some;
+			const auto r = try_read<type_t>( timeout );
+			if( not r )
+				throw std::runtime_error( strerror( errno ) );
+			return r.value;
+		}
+
+		/**
+		 * @brief the non-throwing counterpart of read<type_t>(), the failure
+		 * is reported in the result (and in errno) instead
+		 */
+		template<typename type_t>
+		typename std::enable_if<std::is_trivially_copyable<type_t>::value, value_result<type_t>>::type
+    inline try_read( const std::chrono::milliseconds& timeout = use_global ) noexcept
+		{
+			value_result<type_t> r;
+			r.status = read_all( &r.value, sizeof(r.value), timeout ).status;
+			return r;
 		}
 
 		template<typename type_t>
@@ -292,17 +320,17 @@ namespace serial
 
     clock::time_point get_last_read() const noexcept
     {
-      return last_read;
+      return io ? io->get_last_read() : clock::time_point();
     }
 
     clock::time_point get_last_write() const noexcept
     {
-      return last_write;
+      return io ? io->get_last_write() : clock::time_point();
     }
 
     clock::time_point get_last_access() const noexcept
     {
-      return std::max(last_read, last_write);
+      return std::max(get_last_read(), get_last_write());
     }
 
     void set_timeout( const std::chrono::milliseconds& to )
@@ -322,11 +350,62 @@ namespace serial
 		file( const file& ) = delete;
 		file& operator = ( const file& ) = delete;
 
-		serial_t handle;
+    read_result read( void* data, size_t count, const std::chrono::milliseconds& to, bool all ) noexcept
+    {
+      const auto& stats = line_stats();
+      const std::lock_guard<std::mutex> lock( mutex );
+      const grid::metrics::timer t( stats.read_latency );
+
+			if( timeout < 0s )
+				return read_result::failure( read_result::timeout );
+
+      engine::request r;
+      r.rx = data;
+      r.rx_size = count;
+      r.rx_all = all;
+      r.timeout = to == use_global ? timeout : to;
+
+      const auto c = transfer( std::move( r ) );
+
+      switch( c.status )
+      {
+        case engine::status::ok:
+          return read_result::success( c.amount );
+        case engine::status::timeout:
+          stats.read_timeouts.inc();
+          return read_result::failure( read_result::timeout );
+        default:
+          stats.read_failures.inc();
+          return read_result::failure( read_result::error );
+      }
+    }
+
+    // runs "r" to completion, errno is set on failure
+    engine::completion transfer( engine::request r ) noexcept
+    {
+      if( not io )
+      {
+        errno = EBADF;
+        return { engine::status::error, 0, EBADF };
+      }
+
+      try
+      {
+        const auto c = io->run( std::move( r ) );
+        if( engine::status::ok != c.status )
+          errno = c.error;
+        return c;
+      }
+      catch( const std::bad_alloc& )
+      {
+        errno = ENOMEM;
+        return { engine::status::error, 0, ENOMEM };
+      }
+    }
+
+    std::unique_ptr<engine> io;
     mutable std::mutex mutex;
     std::chrono::milliseconds timeout;
-    clock::time_point last_read;
-    clock::time_point last_write;
 	};
 }
 
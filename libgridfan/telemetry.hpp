@@ -0,0 +1,131 @@
+#ifndef LIBGRIDFAN_TELEMETRY_H
+#define LIBGRIDFAN_TELEMETRY_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace grid
+{
+  struct sample
+  {
+    std::chrono::steady_clock::time_point when;
+    int rpm;
+    int unknown1;
+    int unknown2;
+  };
+
+  /**
+   * @brief fixed-size time series of samples, with one writer and any
+   * amount of lock-free readers.
+   * Every slot is guarded by a sequence number (odd while being written),
+   * which also tells the position it holds: the sample pushed as the Pth
+   * (from 0) leaves 2 * ( P / N + 1 ) in its slot. Readers copy a slot and
+   * discard it if it is not the expected position, before or after the
+   * copy, so a reader never blocks the writer nor vice versa.
+   */
+  template <size_t N>
+  class ring
+  {
+  public:
+
+    static constexpr size_t capacity = N;
+
+    ring() noexcept
+      : head( 0 )
+    {
+      for( auto& s : slots )
+        s.seq.store( 0, std::memory_order_relaxed );
+    }
+
+    /**
+     * @brief appends "s", overwriting the oldest sample when full
+     * @note must be called by a single thread
+     */
+    void push( const sample& s ) noexcept
+    {
+      const auto h = head.load( std::memory_order_relaxed );
+      auto& slot = slots[ h % N ];
+      const auto seq = slot.seq.load( std::memory_order_relaxed );
+
+      slot.seq.store( seq + 1, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_release );
+
+      slot.when.store( s.when.time_since_epoch().count(), std::memory_order_relaxed );
+      slot.rpm.store( s.rpm, std::memory_order_relaxed );
+      slot.unknown1.store( s.unknown1, std::memory_order_relaxed );
+      slot.unknown2.store( s.unknown2, std::memory_order_relaxed );
+
+      slot.seq.store( seq + 2, std::memory_order_release );
+      head.store( h + 1, std::memory_order_release );
+    }
+
+    /**
+     * @brief copies up to "max" of the most recent samples into "out", newest first
+     * @return the amount of samples copied
+     */
+    size_t snapshot( sample* out, size_t max ) const noexcept
+    {
+      const auto h = head.load( std::memory_order_acquire );
+      const auto available = std::min<uint64_t>( h, N );
+      size_t n = 0;
+
+      for( uint64_t k = 0; k < available and n < max; ++k )
+      {
+        const auto position = h - 1 - k;
+        const auto& slot = slots[ position % N ];
+        const auto expected = 2 * ( position / N + 1 );
+
+        // the writer wrapped since "head" was read: this slot holds (or is
+        // getting) a newer sample, and everything older is gone as well
+        if( expected != slot.seq.load( std::memory_order_acquire ) )
+          break;
+
+        sample s;
+        s.when = std::chrono::steady_clock::time_point( std::chrono::steady_clock::duration( slot.when.load( std::memory_order_relaxed ) ) );
+        s.rpm = slot.rpm.load( std::memory_order_relaxed );
+        s.unknown1 = slot.unknown1.load( std::memory_order_relaxed );
+        s.unknown2 = slot.unknown2.load( std::memory_order_relaxed );
+
+        std::atomic_thread_fence( std::memory_order_acquire );
+
+        // overwritten while copying it, everything older is gone as well
+        if( expected != slot.seq.load( std::memory_order_relaxed ) )
+          break;
+
+        out[ n++ ] = s;
+      }
+
+      return n;
+    }
+
+    /**
+     * @brief the amount of samples pushed so far
+     */
+    uint64_t count() const noexcept
+    {
+      return head.load( std::memory_order_acquire );
+    }
+
+  private:
+
+    struct slot_t
+    {
+      std::atomic<uint64_t> seq;
+      std::atomic<std::chrono::steady_clock::rep> when;
+      std::atomic<int> rpm;
+      std::atomic<int> unknown1;
+      std::atomic<int> unknown2;
+    };
+
+    slot_t slots[ N ];
+    std::atomic<uint64_t> head;
+  };
+
+  template <size_t N>
+  constexpr size_t ring<N>::capacity;
+}
+
+#endif // LIBGRIDFAN_TELEMETRY_H
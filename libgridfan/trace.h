@@ -0,0 +1,79 @@
+#ifndef LIBGRIDFAN_TRACE_H
+#define LIBGRIDFAN_TRACE_H
+
+/*
+ * USDT (statically defined) tracepoints, provider "gridfan".
+ * When <sys/sdt.h> is available (systemtap-sdt-dev / systemtap-sdt-devel)
+ * every probe is a note in the ELF file guarded by a semaphore the tracer
+ * bumps while attached: with nobody tracing a probe costs the test of that
+ * semaphore, neither its arguments nor the timestamps are evaluated. Without
+ * <sys/sdt.h> they compile to nothing; define GRIDFAN_NO_TRACE to leave them
+ * out anyway.
+ *
+ * The object firing a probe defines its semaphore once, at file scope, with
+ * GRID_TRACE_PROBE( name ); an interval is only timed when its probe was
+ * already armed at the start, otherwise its elapsed time reads 0.
+ *
+ * Every probe carries three arguments:
+ *
+ *   probe                         arg0          arg1          arg2
+ *   serial_read_entry/_return     fd            first byte    elapsed ns (0 on entry)
+ *   serial_write_entry/_return    fd            first byte    elapsed ns (0 on entry)
+ *   pace_entry/_return            fan index     command byte  elapsed ns (0 on entry)
+ *   engine_pace                   fan index     command byte  ns until the line is free
+ *   init_retry                    attempt       command byte  ns since the init started
+ *   tick                          zones updated interval ms   elapsed ns
+ *
+ * eg. bpftrace -e 'usdt:/usr/local/lib/libgridfan.so:gridfan:pace_return { @[arg1] = hist(arg2); }'
+ */
+
+#if defined(__has_include) && !defined(GRIDFAN_NO_TRACE)
+#  if __has_include(<sys/sdt.h>)
+#    define _SDT_HAS_SEMAPHORES 1
+#    include <sys/sdt.h>
+#    define GRIDFAN_TRACE_ENABLED 1
+#  endif
+#endif
+
+#ifdef GRIDFAN_TRACE_ENABLED
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t grid_trace_now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef __cplusplus
+#  define GRID_TRACE_C( ... ) extern "C" { __VA_ARGS__ }
+#else
+#  define GRID_TRACE_C( ... ) __VA_ARGS__
+#endif
+
+/* the semaphore sys/sdt.h expects for gridfan:"name", non zero while traced */
+#define GRID_TRACE_PROBE( name ) \
+  GRID_TRACE_C( __attribute__(( visibility( "hidden" ), section( ".probes" ) )) unsigned short gridfan_##name##_semaphore; )
+#define GRID_TRACE_ENABLED( name ) __builtin_expect( gridfan_##name##_semaphore, 0 )
+
+/* declares "var", the start of an interval reported by "name", 0 while it is not traced */
+#define GRID_TRACE_START( var, name ) const uint64_t var = GRID_TRACE_ENABLED( name ) ? grid_trace_now() : 0
+#define GRID_TRACE_ELAPSED( var ) ( (var) ? grid_trace_now() - (var) : 0 )
+#define GRID_TRACE( name, a0, a1, a2 ) \
+  do { if( GRID_TRACE_ENABLED( name ) ) DTRACE_PROBE3( gridfan, name, a0, a1, a2 ); } while( 0 )
+/* code only needed to feed the probes */
+#define GRID_TRACE_ONLY( ... ) __VA_ARGS__
+
+#else
+
+/* the arguments are not even evaluated */
+#define GRID_TRACE_PROBE( name )
+#define GRID_TRACE_START( var, name )
+#define GRID_TRACE( name, a0, a1, a2 ) do {} while( 0 )
+#define GRID_TRACE_ONLY( ... )
+
+#endif
+
+#endif /* LIBGRIDFAN_TRACE_H */
@@ -0,0 +1,487 @@
+#include "worker.hpp"
+#include "metrics.hpp"
+
+#include <cerrno>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace grid
+{
+  constexpr size_t worker::max_errors;
+  constexpr size_t worker::history;
+  constexpr size_t worker::slots;
+
+  // registered at load time like the bus metrics
+  namespace
+  {
+    namespace stats
+    {
+      metrics::counter& reinits = metrics::get_counter( "gridfan_bus_reinits_total", "Controller re-initializations after bus failures" );
+    }
+  }
+
+  static uint32_t mask_of( const controller& c )
+  {
+    uint32_t mask = 0;
+    for( const auto& f : c )
+      mask |= 1u << f.id();
+    return mask;
+  }
+
+  static bool consume( int fd ) noexcept
+  {
+    uint64_t count;
+    return sizeof(count) == read( fd, &count, sizeof(count) );
+  }
+
+  // an inotify descriptor watching the directory of "path", or the closest
+  // existing ancestor of it (eg. udev removes /dev/serial/by-id along with
+  // the last serial device), -1 if inotify is not available
+  static int watch_parent( const std::string& path ) noexcept
+  {
+    const int fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+
+    if( fd < 0 )
+      return -1;
+
+    auto dir = path;
+
+    while( true )
+    {
+      const auto slash = dir.find_last_of( '/' );
+      dir = ( std::string::npos == slash ) ? "." : ( slash ? dir.substr( 0, slash ) : "/" );
+
+      if( inotify_add_watch( fd, dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM ) >= 0 )
+        return fd;
+
+      if( "/" == dir or "." == dir )
+        break;
+    }
+
+    close( fd );
+    return -1;
+  }
+
+  worker::worker( controller&& c, const std::string& f )
+    : bus( std::move( c ) )
+    , filename( f )
+    , pending( 0 )
+    , reads( 0 )
+    , fans_mask( mask_of( bus ) )
+    , error_count( 0 )
+    , error( controller::result_t::ok )
+    , gave_up( false )
+    , online( true )
+    , running( true )
+    , sample_period( 0 )
+    , reprobe_period( 0 )
+    , wakeup( eventfd( 0, EFD_CLOEXEC ) )
+    , done( eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) )
+  {
+    for( size_t i = 0; i < slots; ++i )
+    {
+      targets[i] = -1;
+      applied_percent[i] = -1;
+      rpm[i] = -1;
+      last[i] = -1;
+    }
+
+    thread = std::thread( &worker::run, this );
+  }
+
+  worker::~worker()
+  {
+    stop();
+    close( wakeup );
+    close( done );
+  }
+
+  bool worker::set( fan::id_t id, int percent ) noexcept
+  {
+    if( id < 1 or id >= slots or percent < 0 or percent > 100 )
+      return false;
+
+    targets[ id ].store( percent, std::memory_order_release );
+    pending.fetch_or( 1u << id, std::memory_order_release );
+    wake();
+    return true;
+  }
+
+  void worker::set_all( int percent ) noexcept
+  {
+    const auto mask = fans_mask.load( std::memory_order_acquire );
+
+    for( fan::id_t id = 1; id < slots; ++id )
+      if( mask & ( 1u << id ) )
+        targets[ id ].store( percent, std::memory_order_release );
+
+    pending.fetch_or( mask, std::memory_order_release );
+    wake();
+  }
+
+  bool worker::refresh( fan::id_t id ) noexcept
+  {
+    if( id < 1 or id >= slots )
+      return false;
+
+    reads.fetch_or( 1u << id, std::memory_order_release );
+    wake();
+    return true;
+  }
+
+  int worker::applied( fan::id_t id ) const noexcept
+  {
+    return ( id < slots ) ? applied_percent[ id ].load( std::memory_order_acquire ) : -1;
+  }
+
+  int worker::speed( fan::id_t id ) const noexcept
+  {
+    return ( id < slots ) ? rpm[ id ].load( std::memory_order_acquire ) : -1;
+  }
+
+  void worker::sample_every( const std::chrono::milliseconds& period ) noexcept
+  {
+    sample_period = std::max( 0ms, period ).count();
+    wake();
+  }
+
+  void worker::reprobe_every( const std::chrono::milliseconds& period ) noexcept
+  {
+    reprobe_period = std::max( 0ms, period ).count();
+    wake();
+  }
+
+  size_t worker::telemetry( fan::id_t id, sample* out, size_t max ) const noexcept
+  {
+    return ( id < slots ) ? series[ id ].snapshot( out, max ) : 0;
+  }
+
+  uint32_t worker::fans() const noexcept
+  {
+    return fans_mask.load( std::memory_order_acquire );
+  }
+
+  size_t worker::errors() const noexcept
+  {
+    return error_count.load( std::memory_order_acquire );
+  }
+
+  controller::result_t worker::last_error() const noexcept
+  {
+    return error.load( std::memory_order_acquire );
+  }
+
+  bool worker::failed() const noexcept
+  {
+    return gave_up.load( std::memory_order_acquire );
+  }
+
+  bool worker::connected() const noexcept
+  {
+    return online.load( std::memory_order_acquire );
+  }
+
+  int worker::fd() const noexcept
+  {
+    return done;
+  }
+
+  void worker::stop()
+  {
+    running = false;
+    wake();
+
+    if( thread.joinable() )
+      thread.join();
+  }
+
+  const controller& worker::get_controller() const
+  {
+    return bus;
+  }
+
+  void worker::wake() noexcept
+  {
+    const uint64_t one = 1;
+    while( -1 == write( wakeup, &one, sizeof(one) ) and EINTR == errno )
+      ;
+  }
+
+  void worker::publish() noexcept
+  {
+    const uint64_t one = 1;
+    while( -1 == write( done, &one, sizeof(one) ) and EINTR == errno )
+      ;
+  }
+
+  void worker::run()
+  {
+    using clock = std::chrono::steady_clock;
+
+    auto next_sample = clock::now();
+    auto next_probe = clock::now();
+
+    while( running )
+    {
+      const auto period = std::chrono::milliseconds( sample_period.load() );
+      const auto probe = std::chrono::milliseconds( reprobe_period.load() );
+      auto deadline = clock::time_point::max();
+      int wait = -1;
+
+      if( period > 0ms )
+        deadline = next_sample;
+
+      if( probe > 0ms )
+        deadline = std::min( deadline, next_probe );
+
+      if( deadline != clock::time_point::max() and not gave_up )
+        wait = int( std::max( 0ms, std::chrono::duration_cast<std::chrono::milliseconds>( deadline - clock::now() ) ).count() );
+
+      // the idle engine reports the line hanging up, eg. the hub leaving
+      // while nothing is sent to it
+      auto* line = bus.get_engine();
+      struct pollfd pfd[2] = { { wakeup, POLLIN, 0 }, { line ? line->fd() : -1, POLLIN, 0 } };
+
+      if( poll( pfd, 2, wait ) < 0 )
+        continue;
+
+      if( pfd[0].revents & POLLIN )
+        consume( wakeup );
+
+      if( pfd[1].revents & POLLIN )
+        line->process();
+
+      if( not running or gave_up )
+        continue;
+
+      bool ok = pass();
+
+      if( ok and line and line->hung_up() )
+      {
+        ok = false;
+        error = controller::result_t::io_error;
+        ++error_count;
+        publish();
+      }
+
+      if( ok and period > 0ms and clock::now() >= next_sample )
+      {
+        ok = collect();
+        next_sample = clock::now() + period;
+      }
+
+      if( ok and probe > 0ms and clock::now() >= next_probe )
+      {
+        reprobe();
+        next_probe = clock::now() + probe;
+      }
+
+      if( not ok and not recover() )
+      {
+        gave_up = true;
+        publish();
+      }
+    }
+  }
+
+  // picks up whatever is in the mailbox and runs it as a single batch
+  bool worker::pass()
+  {
+    const auto mask = fans_mask.load( std::memory_order_relaxed );
+    const auto sets = pending.exchange( 0, std::memory_order_acquire );
+    const auto gets = reads.exchange( 0, std::memory_order_acquire ) & mask;
+
+    std::vector<controller::command> commands;
+    commands.reserve( 2 * slots );
+
+    for( fan::id_t id = 1; id < slots; ++id )
+    {
+      if( not ( sets & ( 1u << id ) ) )
+        continue;
+
+      const auto p = targets[ id ].exchange( -1, std::memory_order_acquire );
+
+      if( p < 0 )
+        continue;
+
+      // empty channels get their target once a fan shows up, see reprobe()
+      last[ id ] = p;
+
+      if( mask & ( 1u << id ) )
+        commands.push_back( controller::command::setPercent( id, p ) );
+    }
+
+    for( fan::id_t id = 1; id < slots; ++id )
+      if( gets & ( 1u << id ) )
+        commands.push_back( controller::command::getSpeed( id ) );
+
+    if( commands.empty() )
+      return true;
+
+    const auto replies = bus.execute( commands );
+    bool ok = true;
+
+    for( size_t i = 0; i < replies.size(); ++i )
+    {
+      const auto& cmd = commands[ i ];
+      const auto& rep = replies[ i ];
+
+      if( controller::result_t::ok != rep.result )
+      {
+        ok = false;
+        error = rep.result;
+        continue;
+      }
+
+      if( cmd.sets() )
+        applied_percent[ cmd.id ].store( cmd.value, std::memory_order_release );
+      else
+        rpm[ cmd.id ].store( rep.value, std::memory_order_release );
+    }
+
+    if( ok )
+      error_count = 0;
+    else
+      ++error_count;
+
+    publish();
+    return ok;
+  }
+
+  // reads the registers of every fan, one fan at a time so that a target
+  // posted in the meanwhile has to wait for three commands at most
+  bool worker::collect()
+  {
+    const auto mask = fans_mask.load( std::memory_order_acquire );
+
+    for( fan::id_t id = 1; id < slots; ++id )
+    {
+      if( not ( mask & ( 1u << id ) ) )
+        continue;
+
+      if( ( pending.load( std::memory_order_acquire ) or reads.load( std::memory_order_acquire ) ) and not pass() )
+        return false;
+
+      const auto replies = bus.execute( {
+        controller::command::getSpeed( id ),
+        controller::command::getUnknown1( id ),
+        controller::command::getUnknown2( id )
+      } );
+
+      for( const auto& rep : replies )
+      {
+        if( controller::result_t::ok != rep.result )
+        {
+          error = rep.result;
+          ++error_count;
+          publish();
+          return false;
+        }
+      }
+
+      series[ id ].push( { std::chrono::steady_clock::now(), replies[0].value, replies[1].value, replies[2].value } );
+      rpm[ id ].store( replies[0].value, std::memory_order_release );
+    }
+
+    error_count = 0;
+    publish();
+    return true;
+  }
+
+  // looks for fans connected to the empty channels, the new ones get their
+  // last target right away
+  void worker::reprobe()
+  {
+    if( 0 == bus.reprobe() )
+      return;
+
+    const auto before = fans_mask.load( std::memory_order_relaxed );
+    fans_mask = mask_of( bus );
+    repost( fans_mask & ~before );
+    publish();
+  }
+
+  void worker::repost( uint32_t mask ) noexcept
+  {
+    for( fan::id_t id = 1; id < slots; ++id )
+    {
+      int none = -1;
+      if( ( mask & ( 1u << id ) ) and last[ id ] >= 0 and targets[ id ].compare_exchange_strong( none, last[ id ] ) )
+        pending.fetch_or( 1u << id, std::memory_order_release );
+    }
+
+    wake();
+  }
+
+  // Re-opens the controller as soon as its device node is there: the
+  // directory of the node is watched, so a hub coming back from a USB
+  // re-enumeration is picked up right away and one that never left is
+  // re-opened at once. The channels found so far are assumed to be still
+  // populated (no spin-up probe) and get their last target back right away,
+  // the empty ones are left to reprobe().
+  bool worker::recover()
+  {
+    if( error_count >= max_errors )
+      return false;
+
+    const auto t = bus.get_timings();
+    const auto mask = fans_mask.load( std::memory_order_relaxed );
+    size_t attempts = 0;
+
+    // the device might be re-enumerated only once the old node is released
+    bus.close();
+
+    while( running )
+    {
+      // armed before looking for the node, so that its creation is not missed
+      const int watch = watch_parent( filename );
+
+      if( 0 == access( filename.c_str(), F_OK ) )
+      {
+        stats::reinits.inc();
+        bus = controller( std::nothrow, filename );
+
+        if( bus )
+        {
+          if( -1 != watch )
+            close( watch );
+
+          bus.set_timings( t );
+          bus.assume( mask );
+
+          if( not online.exchange( true ) )
+            publish();
+
+          repost( mask );
+          return true;
+        }
+
+        if( ++attempts >= max_errors )
+        {
+          if( -1 != watch )
+            close( watch );
+          return false;
+        }
+      }
+      else if( online.exchange( false ) )
+      {
+        publish();
+      }
+
+      // a change in the directory, stop() or a second, whichever comes first
+      struct pollfd pfd[2] = { { wakeup, POLLIN, 0 }, { watch, POLLIN, 0 } };
+
+      if( poll( pfd, ( -1 == watch ) ? 1 : 2, 1000 ) > 0 and ( pfd[0].revents & POLLIN ) )
+        consume( wakeup );
+
+      if( -1 != watch )
+        close( watch );
+    }
+
+    return true;
+  }
+}
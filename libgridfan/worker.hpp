@@ -0,0 +1,169 @@
+#ifndef LIBGRIDFAN_WORKER_H
+#define LIBGRIDFAN_WORKER_H
+
+#include "libgridfan.hpp"
+#include "telemetry.hpp"
+
+#include <atomic>
+#include <thread>
+
+namespace grid
+{
+  /**
+   * @brief optional bus owner thread.
+   * The worker takes ownership of a controller and is the only one talking
+   * to the bus, the other threads post commands and read results back
+   * through a lock-free mailbox:
+   * - every fan has a target slot, posting a new target while the previous
+   *   one is still waiting simply replaces it (the bus never falls behind);
+   * - a pending bitmask tells the worker which slots to pick up, so several
+   *   producers can post concurrently (MPSC);
+   * - results are published as atomics and signalled on fd().
+   * When the mailbox is empty the worker can also sample the speed and the
+   * unknown registers of every fan into a per fan time series, and look
+   * for fans connected to the empty channels (see controller::detect()).
+   * Targets posted for empty channels are kept and applied once a fan shows up.
+   * Failures, including the line hanging up while the bus is idle, are
+   * retried by re-initializing the controller as soon as its device node
+   * exists (see recover()): while it is missing, eg. during a
+   * USB re-enumeration, the worker waits for it and connected() is false.
+   * After max_errors consecutive failures the worker gives up and failed()
+   * is set.
+   */
+  class worker
+  {
+  public:
+
+    static constexpr size_t max_errors = 5;
+    static constexpr size_t history = 128; // samples kept per fan
+
+    worker( controller&& c, const std::string& filename = "/dev/GridPlus0" );
+    ~worker();
+
+    /**
+     * @brief posts a new target for fan "id", never blocks
+     * @return false if "id" or "percent" are not valid
+     */
+    bool set( fan::id_t id, int percent ) noexcept;
+
+    /**
+     * @brief posts the same target for all the fans
+     */
+    void set_all( int percent ) noexcept;
+
+    /**
+     * @brief asks for the speed of fan "id" to be read back
+     */
+    bool refresh( fan::id_t id ) noexcept;
+
+    /**
+     * @brief the last percent acknowledged by fan "id", -1 if unknown
+     */
+    int applied( fan::id_t id ) const noexcept;
+
+    /**
+     * @brief the last speed (RPM) read from fan "id", -1 if unknown
+     */
+    int speed( fan::id_t id ) const noexcept;
+
+    /**
+     * @brief samples all the fans every "period" while the bus is idle, 0 disables it
+     */
+    void sample_every( const std::chrono::milliseconds& period ) noexcept;
+
+    /**
+     * @brief copies up to "max" of the most recent samples of fan "id"
+     * into "out", newest first, without blocking the bus thread
+     * @return the amount of samples copied
+     */
+    size_t telemetry( fan::id_t id, sample* out, size_t max ) const noexcept;
+
+    /**
+     * @brief reads the empty channels every "period" while the bus is idle, 0 disables it
+     */
+    void reprobe_every( const std::chrono::milliseconds& period ) noexcept;
+
+    /**
+     * @brief the bitmask of the populated channels (bit N = fan N)
+     */
+    uint32_t fans() const noexcept;
+
+    /**
+     * @brief the amount of consecutive failed bus passes
+     */
+    size_t errors() const noexcept;
+
+    /**
+     * @brief the outcome of the last failed bus pass
+     */
+    controller::result_t last_error() const noexcept;
+
+    /**
+     * @brief true once the worker gave up
+     */
+    bool failed() const noexcept;
+
+    /**
+     * @brief false while the device node is missing and the worker waits for it
+     */
+    bool connected() const noexcept;
+
+    /**
+     * @brief an eventfd signalled every time new results are published
+     */
+    int fd() const noexcept;
+
+    /**
+     * @brief stops and joins the bus thread, pending targets are dropped
+     */
+    void stop();
+
+    /**
+     * @brief the owned controller
+     * @note only safe to use after stop()
+     */
+    const controller& get_controller() const;
+
+  private:
+
+    worker( const worker& ) = delete;
+    worker& operator = ( const worker& ) = delete;
+
+    static constexpr size_t slots = 7; // fan ids go from 1 to 6
+
+    void run();
+    bool pass();
+    bool recover();
+    bool collect();
+    void reprobe();
+    void repost( uint32_t mask ) noexcept;
+    void wake() noexcept;
+    void publish() noexcept;
+
+    controller bus;
+    const std::string filename;
+
+    std::atomic<int> targets[slots];
+    std::atomic<uint32_t> pending;
+    std::atomic<uint32_t> reads;
+    std::atomic<uint32_t> fans_mask;
+
+    std::atomic<int> applied_percent[slots];
+    std::atomic<int> rpm[slots];
+    std::atomic<size_t> error_count;
+    std::atomic<controller::result_t> error;
+    std::atomic<bool> gave_up;
+    std::atomic<bool> online;
+    std::atomic<bool> running;
+    std::atomic<std::chrono::milliseconds::rep> sample_period;
+    std::atomic<std::chrono::milliseconds::rep> reprobe_period;
+    ring<history> series[slots];
+
+    int wakeup;
+    int done;
+    int last[slots];
+    std::thread thread;
+  };
+}
+
+#endif // LIBGRIDFAN_WORKER_H